@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Generates march workloads for benchmarking.
+
+Each workload stresses one part of the implementation, and scales
+linearly with --size:
+
+  globals   many distinct globals, each defined once
+  tuples    deep and wide tuple literals, constant and not
+  reassign  a few globals reassigned over and over, making garbage
+  typed     typed lets and checked reassignments
+  print     large volumes of printed output
+
+Output is deterministic for a given workload, size and seed.
+"""
+
+import argparse
+import random
+import sys
+
+WORKLOADS = ["globals", "tuples", "reassign", "typed", "print"]
+
+
+def gen_globals(size, rng, out):
+    for i in range(size):
+        if i % 2 == 0:
+            out.write(f"let g{i} := {i};\n")
+        else:
+            out.write(f'let g{i} := "s{i}";\n')
+    for i in range(0, size, 97):
+        out.write(f"print g{i};\n")
+
+
+def deep_tuple(depth, leaf):
+    text = leaf
+    for d in range(depth):
+        text = f"({d}, {text})"
+    return text
+
+
+def gen_tuples(size, rng, out):
+    out.write("let base := 0;\n")
+    for i in range(size):
+        kind = i % 4
+        if kind == 0:
+            tuple = deep_tuple(16, f'"leaf{i}"')
+        elif kind == 1:
+            tuple = "(" + ", ".join(str(i + j) for j in range(32)) + ")"
+        elif kind == 2:
+            # Not constant, so it's built every time
+            tuple = deep_tuple(16, "base")
+        else:
+            tuple = "(" + ", ".join("base" if j % 3 == 0 else str(j) for j in range(32)) + ")"
+        out.write(f"let t{i} := {tuple};\n")
+    for i in range(0, size, 101):
+        out.write(f"print t{i};\n")
+
+
+def gen_reassign(size, rng, out):
+    count = 64
+    for i in range(count):
+        out.write(f'let r{i} := ({i}, "r{i}");\n')
+    for k in range(size):
+        a = rng.randrange(count)
+        b = rng.randrange(count)
+        choice = rng.random()
+        # Only one global on each right-hand side, so values grow
+        # linearly rather than doubling, and most of them soon become
+        # garbage
+        if choice < 0.6:
+            out.write(f'r{a} = (r{b}, ({k}, "x"));\n')
+        elif choice < 0.9:
+            out.write(f"r{a} = r{b};\n")
+        else:
+            out.write(f"r{a} = ({k}, \"y\");\n")
+    for i in range(count):
+        out.write(f"print r{i};\n")
+
+
+def gen_typed(size, rng, out):
+    out.write("let kind := typeof (0, 0);\n")
+    for i in range(size):
+        kind = i % 4
+        if kind == 0:
+            out.write(f"let i{i} : int = {i};\n")
+            out.write(f"i{i} = {i + 1};\n")
+        elif kind == 1:
+            out.write(f'let s{i} : string = "s{i}";\n')
+            out.write(f's{i} = "t{i}";\n')
+        elif kind == 2:
+            out.write(f"let u{i} : tuple = ({i}, i{i - 2});\n")
+            out.write(f"u{i} = (i{i - 2}, {i});\n")
+        else:
+            out.write(f"let v{i} : kind = (s{i - 2}, {i});\n")
+            out.write(f"let w{i} := typeof v{i};\n")
+
+
+def gen_print(size, rng, out):
+    out.write('let line := (1, "two", (3, "four", (5, "six")));\n')
+    out.write("let n := 42;\n")
+    for i in range(size):
+        if i % 3 == 0:
+            out.write("print line;\n")
+        elif i % 3 == 1:
+            out.write("print n;\n")
+        else:
+            out.write(f'print ({i}, "p", n);\n')
+
+
+GENERATORS = {
+    "globals": gen_globals,
+    "tuples": gen_tuples,
+    "reassign": gen_reassign,
+    "typed": gen_typed,
+    "print": gen_print,
+}
+
+
+def write_workload(workload, size, seed, out):
+    """Writes one workload to out; the same arguments give the same output."""
+    GENERATORS[workload](size, random.Random(seed), out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("workload", choices=WORKLOADS)
+    parser.add_argument("--size", type=int, default=10000)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    write_workload(args.workload, args.size, args.seed, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
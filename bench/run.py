@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Runs every generated workload through march and records phase timings.
+
+For each workload and each VM mode, march is run with --timings a few
+times, and the fastest time for each phase is kept. Results go out as
+JSON lines, one per workload and mode. Each line holds the phase times
+in milliseconds as reported by march.
+
+With --baseline, results are compared against an earlier results file.
+The script exits non-zero if any phase got slower by more than
+--tolerance. Phases under --noise-ms are too short to judge and are
+skipped.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import generate
+
+MODES = {
+    "stack": [],
+    "stack-whole": ["--whole-program"],
+    "register": ["--vm=register"],
+}
+PHASES = ["lex_ms", "parse_ms", "compile_ms", "execute_ms", "gc_ms", "total_ms"]
+
+
+def run_once(march, flags, path):
+    result = subprocess.run([march, "--timings"] + flags + [path],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            text=True)
+    if result.returncode != 0:
+        sys.exit(f"march failed on {path}:\n{result.stderr}")
+    # The timings are always the last line march writes to stderr
+    return json.loads(result.stderr.strip().splitlines()[-1])
+
+
+def run_workload(march, workload, size, mode, path, repeat):
+    best = None
+    for _ in range(repeat):
+        timings = run_once(march, MODES[mode], path)
+        if best is None:
+            best = timings
+        else:
+            for phase in PHASES:
+                best[phase] = min(best[phase], timings[phase])
+    record = {"workload": workload, "size": size, "mode": mode}
+    for phase in PHASES:
+        record[phase] = best[phase]
+    record["collections"] = best["collections"]
+    return record
+
+
+def load_results(path):
+    with open(path) as f:
+        records = (json.loads(line) for line in f if line.strip())
+        return {(r["workload"], r["mode"]): r for r in records}
+
+
+def compare(results, baseline, tolerance, noise_ms):
+    regressions = 0
+    for record in results:
+        key = (record["workload"], record["mode"])
+        if key not in baseline:
+            continue
+        old = baseline[key]
+        for phase in PHASES:
+            if max(old[phase], record[phase]) < noise_ms:
+                continue
+            if record[phase] > old[phase] * (1 + tolerance):
+                regressions += 1
+                print(f"REGRESSION {key[0]}/{key[1]} {phase}: "
+                      f"{old[phase]:.3f} -> {record[phase]:.3f} ms", file=sys.stderr)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--march", default="./march")
+    parser.add_argument("--size", type=int, default=20000)
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--workloads", default=",".join(generate.WORKLOADS))
+    parser.add_argument("--out", help="also write results here")
+    parser.add_argument("--baseline", help="results file to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.15)
+    parser.add_argument("--noise-ms", type=float, default=2.0)
+    args = parser.parse_args()
+
+    results = []
+    with tempfile.TemporaryDirectory() as workdir:
+        for workload in args.workloads.split(","):
+            path = os.path.join(workdir, f"{workload}.march")
+            with open(path, "w") as f:
+                generate.write_workload(workload, args.size, args.seed, f)
+            for mode in MODES:
+                record = run_workload(args.march, workload, args.size, mode,
+                                      path, args.repeat)
+                results.append(record)
+                print(json.dumps(record), flush=True)
+
+    if args.out:
+        with open(args.out, "w") as f:
+            for record in results:
+                f.write(json.dumps(record) + "\n")
+    if args.baseline:
+        regressions = compare(results, load_results(args.baseline),
+                              args.tolerance, args.noise_ms)
+        if regressions:
+            sys.exit(f"{regressions} phase(s) regressed")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,111 +1,199 @@
 #pragma once
 
 #include <assert.h>
+#include <new>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <type_traits>
+#include <utility>
+
+template <typename T, size_t Inline>
+struct List_Inline_Storage {
+	T items[Inline];
+	T * inline_items() { return items; }
+};
 
 template <typename T>
-struct List {
+struct List_Inline_Storage<T, 0> {
+	T * inline_items() { return NULL; }
+};
+
+/** List
+ * A growable array. If Inline is non-zero, the first Inline elements
+ * live inside the List itself and no allocation happens until it
+ * outgrows them --- but then the List must not be copied by value
+ * while it's still using them, because arr would point into the
+ * original.
+ */
+template <typename T, size_t Inline = 0>
+struct List : List_Inline_Storage<T, Inline> {
 	T * arr;
 	size_t size;
 	size_t capacity;
+	bool shrinks; // Whether pop() gives memory back; on by default
 	void alloc();
-	List<T> copy();
+	List<T, Inline> copy();
 	void dealloc();
 	void resize(size_t new_capacity);
+	void reserve(size_t min_capacity);
 	void possibly_grow_to_size(size_t new_size);
 	void push(T to_push);
+	template <typename... Args>
+	T& emplace(Args&&... args);
+	void append(const T * items, size_t count);
 	void possibly_shrink_to_size(size_t query_size);
 	T pop();
+	void clear();
 	T at(size_t index);
 	T& operator[](size_t index);
-	static constexpr int   initial_size  = 4;
+	bool is_inline();
+	static constexpr int   initial_size  = Inline > 4 ? Inline : 4;
 	static constexpr float grow_factor   = 2.0;
 	static constexpr float shrink_line   = 0.25;
 	static constexpr float shrink_factor = 0.5;
+	// Small lists never shrink, which keeps stack-like lists that
+	// hover around a few elements from reallocating on every push/pop
+	static constexpr size_t min_shrink_capacity = 64;
 };
 
-template <typename T>
-void List<T>::alloc()
+template <typename T, size_t Inline>
+bool List<T, Inline>::is_inline()
+{
+	return Inline > 0 && arr == this->inline_items();
+}
+
+template <typename T, size_t Inline>
+void List<T, Inline>::alloc()
 {
 	size = 0;
-	capacity = List::initial_size;
-	arr = (T*) malloc(sizeof(T) * capacity);
+	shrinks = true;
+	if (Inline > 0) {
+		capacity = Inline;
+		arr = this->inline_items();
+	} else {
+		capacity = List::initial_size;
+		arr = (T*) malloc(sizeof(T) * capacity);
+	}
 }
 
-template <typename T>
-List<T> List<T>::copy()
+// The copy is always heap-allocated, so it's safe to pass around
+template <typename T, size_t Inline>
+List<T, Inline> List<T, Inline>::copy()
 {
-	List<T> list;
+	List<T, Inline> list;
 	list.size = size;
 	list.capacity = capacity;
+	list.shrinks = shrinks;
 	list.arr = (T*) malloc(sizeof(T) * capacity);
 	memcpy(list.arr, arr, sizeof(T) * size);
 	return list;
 }
 
-template <typename T>
-void List<T>::dealloc()
+template <typename T, size_t Inline>
+void List<T, Inline>::dealloc()
 {
-	free(arr);
+	if (!is_inline()) free(arr);
+	arr = NULL;
 	size = 0;
 	capacity = 0;
 }
 
-template <typename T>
-void List<T>::resize(size_t new_capacity)
+template <typename T, size_t Inline>
+void List<T, Inline>::resize(size_t new_capacity)
 {
 	assert(new_capacity >= size);
-	T * new_arr = (T*) malloc(sizeof(T) * new_capacity);
-	memcpy(new_arr, arr, sizeof(T) * size);
-	free(arr);
-	arr = new_arr;
+	if (std::is_trivially_copyable<T>::value && !is_inline()) {
+		arr = (T*) realloc(arr, sizeof(T) * new_capacity);
+	} else {
+		T * new_arr = (T*) malloc(sizeof(T) * new_capacity);
+		memcpy(new_arr, arr, sizeof(T) * size);
+		if (!is_inline()) free(arr);
+		arr = new_arr;
+	}
 	capacity = new_capacity;
 }
 
-template <typename T>
-void List<T>::possibly_grow_to_size(size_t query_size)
+template <typename T, size_t Inline>
+void List<T, Inline>::reserve(size_t min_capacity)
+{
+	if (min_capacity > capacity) {
+		resize(min_capacity);
+	}
+}
+
+template <typename T, size_t Inline>
+void List<T, Inline>::possibly_grow_to_size(size_t query_size)
 {
 	if (query_size > capacity) {
-		resize(capacity * List::grow_factor);
+		size_t new_capacity = capacity * List::grow_factor;
+		if (new_capacity < query_size) new_capacity = query_size;
+		resize(new_capacity);
 	}
 }
 
-template <typename T>
-void List<T>::push(T to_push)
+template <typename T, size_t Inline>
+void List<T, Inline>::push(T to_push)
 {
 	possibly_grow_to_size(size + 1);
 	arr[size++] = to_push;
 }
 
-template <typename T>
-void List<T>::possibly_shrink_to_size(size_t query_size)
+// Constructs the new element in place, and returns it
+template <typename T, size_t Inline>
+template <typename... Args>
+T& List<T, Inline>::emplace(Args&&... args)
+{
+	possibly_grow_to_size(size + 1);
+	T * slot = new (&arr[size++]) T(std::forward<Args>(args)...);
+	return *slot;
+}
+
+template <typename T, size_t Inline>
+void List<T, Inline>::append(const T * items, size_t count)
+{
+	possibly_grow_to_size(size + count);
+	memcpy(arr + size, items, sizeof(T) * count);
+	size += count;
+}
+
+template <typename T, size_t Inline>
+void List<T, Inline>::possibly_shrink_to_size(size_t query_size)
 {
-	if (query_size < (int) (capacity * List::shrink_line)) {
-		resize((int) capacity * List::shrink_factor);
+	if (!shrinks || capacity <= List::min_shrink_capacity || is_inline()) {
+		return;
+	}
+	if (query_size < (size_t) (capacity * List::shrink_line)) {
+		resize((size_t) (capacity * List::shrink_factor));
 	}
 }
 
-template <typename T>
-T List<T>::pop()
+template <typename T, size_t Inline>
+T List<T, Inline>::pop()
 {
 	assert(size > 0);
 	possibly_shrink_to_size(size - 1);
 	return arr[--size];
 }
 
-template <typename T>
-T List<T>::at(size_t index)
+// Empties the list, but keeps its memory around
+template <typename T, size_t Inline>
+void List<T, Inline>::clear()
+{
+	size = 0;
+}
+
+template <typename T, size_t Inline>
+T List<T, Inline>::at(size_t index)
 {
 	assert(index < size);
 	return arr[index];
 }
 
-template <typename T>
-T& List<T>::operator[](size_t index)
+template <typename T, size_t Inline>
+T& List<T, Inline>::operator[](size_t index)
 {
 	assert(index < size);
 	return arr[index];
@@ -0,0 +1,68 @@
+/** Arena
+ * A bump-pointer allocator over a chain of large blocks. Nothing
+ * allocated out of an arena is ever freed individually --- the whole
+ * thing is released at once. Pointers handed out stay valid until
+ * then, since blocks are never moved.
+ */
+struct Arena {
+	List<uint8_t*> blocks;
+	uint8_t * cursor;
+	uint8_t * limit;
+	size_t block_size;
+	static constexpr size_t default_block_size = 64 * 1024;
+	void alloc(size_t block_size = Arena::default_block_size)
+	{
+		blocks.alloc();
+		cursor = NULL;
+		limit = NULL;
+		this->block_size = block_size;
+	}
+	void dealloc()
+	{
+		for (int i = 0; i < blocks.size; i++) {
+			free(blocks[i]);
+		}
+		blocks.dealloc();
+		cursor = NULL;
+		limit = NULL;
+	}
+	void new_block(size_t min_size)
+	{
+		// Blocks double in size so that the number of blocks stays
+		// logarithmic in the number of bytes allocated. block_size is
+		// always the size of the last block.
+		if (blocks.size > 0) block_size *= 2;
+		while (block_size < min_size) block_size *= 2;
+		uint8_t * block = (uint8_t*) malloc(block_size);
+		blocks.push(block);
+		cursor = block;
+		limit = block + block_size;
+	}
+	/** reset
+	 * Throws away everything allocated so far, but hangs on to the
+	 * biggest block to allocate out of next time. After the first
+	 * reset that's usually the only block, so this is constant time.
+	 */
+	void reset()
+	{
+		if (blocks.size == 0) return;
+		uint8_t * biggest = blocks[blocks.size - 1];
+		for (int i = 0; i < blocks.size - 1; i++) {
+			free(blocks[i]);
+		}
+		blocks.clear();
+		blocks.push(biggest);
+		cursor = biggest;
+		limit = biggest + block_size;
+	}
+	void * push(size_t size, size_t align = alignof(max_align_t))
+	{
+		uintptr_t aligned = ((uintptr_t) cursor + (align - 1)) & ~(uintptr_t) (align - 1);
+		if (cursor == NULL || aligned + size > (uintptr_t) limit) {
+			new_block(size + align);
+			aligned = ((uintptr_t) cursor + (align - 1)) & ~(uintptr_t) (align - 1);
+		}
+		cursor = (uint8_t*) (aligned + size);
+		return (void*) aligned;
+	}
+};
@@ -0,0 +1,576 @@
+/** Bytecode_Cache
+ * Saves a whole compiled stack program next to its source, as
+ * "<source>.marchc", so later runs can skip lexing, parsing and
+ * compiling it.
+ *
+ * The file is a Header followed by four sections:
+ *   strings   - u32 length and the bytes, for every string referenced
+ *   globals   - u32 string index of each global's symbol, in slot order
+ *   constants - u64 length and the elements of each permanent tuple,
+ *               children before parents
+ *   instrs    - the Instr array itself, 16-byte aligned
+ *
+ * Values in the file keep their type, but a pointer payload is swapped
+ * for an index: strings and tuples index their sections, and a type
+ * is packed as val_type | obj_type << 8. Loading maps the file
+ * privately and patches the instructions back in place, so they run
+ * straight out of the mapping.
+ *
+ * A cache is only used if its version, instruction layout and source
+ * hash all match; otherwise it's rebuilt. Writing is best-effort.
+ */
+namespace Bytecode_Cache {
+	static constexpr char magic[8] = { 'M', 'A', 'R', 'C', 'H', 'B', 'C', '\n' };
+	// Bump whenever the file layout or the meaning of any Instr changes
+	static constexpr uint32_t format_version = 1;
+	enum {
+		FLAG_PEEPHOLE = 1 << 0,
+		FLAG_TYPE_CHECK = 1 << 1,
+	};
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t instr_size;  // sizeof(Instr)
+		uint32_t instr_kinds; // INSTR_COUNT
+		uint32_t flags;
+		uint64_t source_hash;
+		uint64_t source_length;
+		uint32_t string_count;
+		uint32_t global_count;
+		uint32_t constant_count;
+		uint32_t instr_count;
+		uint64_t strings_offset;
+		uint64_t globals_offset;
+		uint64_t constants_offset;
+		uint64_t instrs_offset;
+		uint64_t file_size;
+	};
+
+	uint64_t hash_source(const char * data, size_t length)
+	{
+		// 64-bit FNV-1a
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < length; i++) {
+			hash ^= (uint8_t) data[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+	uint32_t current_flags()
+	{
+		return (Peephole::enabled ? FLAG_PEEPHOLE : 0) |
+			(Type_Check::enabled ? FLAG_TYPE_CHECK : 0);
+	}
+	char * path_for(const char * source_path)
+	{
+		Sink sink;
+		sink.alloc();
+		sink.write(source_path);
+		sink.write(".marchc");
+		return sink.take_string();
+	}
+
+	/** Pointer_Index
+	 * Numbers pointers in the order they're first added. Open
+	 * addressing on the pointer itself.
+	 */
+	struct Pointer_Index {
+		struct Entry {
+			const void * ptr; // NULL for an empty slot
+			uint32_t index;
+		};
+		Entry * table;
+		size_t capacity; // Always a power of two
+		size_t count;
+		void alloc()
+		{
+			capacity = 64;
+			count = 0;
+			table = (Entry*) calloc(capacity, sizeof(Entry));
+		}
+		void dealloc()
+		{
+			free(table);
+		}
+		size_t slot_for(const void * ptr)
+		{
+			// Interned strings are packed tightly, so the pointer
+			// bits need mixing or they'd pile up in one cluster
+			size_t slot = Symbol_Table::hash_symbol((const char*) ptr) & (capacity - 1);
+			while (table[slot].ptr && table[slot].ptr != ptr) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			return slot;
+		}
+		// Returns the existing index, or -1
+		int64_t find(const void * ptr)
+		{
+			size_t slot = slot_for(ptr);
+			return table[slot].ptr ? (int64_t) table[slot].index : -1;
+		}
+		uint32_t add(const void * ptr)
+		{
+			if ((count + 1) * 2 > capacity) {
+				Entry * old = table;
+				size_t old_capacity = capacity;
+				capacity *= 2;
+				table = (Entry*) calloc(capacity, sizeof(Entry));
+				for (size_t i = 0; i < old_capacity; i++) {
+					if (old[i].ptr) table[slot_for(old[i].ptr)] = old[i];
+				}
+				free(old);
+			}
+			uint32_t index = count++;
+			table[slot_for(ptr)] = (Entry) { ptr, index };
+			return index;
+		}
+	};
+
+	struct Writer {
+		Sink strings;
+		Sink constants;
+		Pointer_Index string_index;
+		Pointer_Index constant_index;
+		void alloc()
+		{
+			strings.alloc();
+			constants.alloc();
+			string_index.alloc();
+			constant_index.alloc();
+		}
+		void dealloc()
+		{
+			strings.dealloc();
+			constants.dealloc();
+			string_index.dealloc();
+			constant_index.dealloc();
+		}
+		uint32_t add_string(const char * string)
+		{
+			int64_t found = string_index.find(string);
+			if (found != -1) return found;
+			uint32_t length = strlen(string);
+			strings.write((const char*) &length, sizeof(length));
+			strings.write(string, length);
+			return string_index.add(string);
+		}
+		uint32_t add_constant(Obj_Tuple * tuple)
+		{
+			int64_t found = constant_index.find(tuple);
+			if (found != -1) return found;
+			// Children first, so that loading can resolve them as it goes
+			uint64_t length = tuple->length;
+			Value * encoded = (Value*) malloc(sizeof(Value) * length);
+			for (size_t i = 0; i < length; i++) {
+				encoded[i] = encode(tuple->elements[i]);
+			}
+			constants.write((const char*) &length, sizeof(length));
+			constants.write((const char*) encoded, sizeof(Value) * length);
+			free(encoded);
+			return constant_index.add(tuple);
+		}
+		Value encode(Value value)
+		{
+			Value encoded;
+			memset(&encoded, 0, sizeof(encoded));
+			encoded.type = value.type;
+			switch (value.type) {
+			case VALUE_INTEGER:
+				encoded.integer = value.integer;
+				break;
+			case VALUE_STRING:
+				encoded.integer = add_string(value.string);
+				break;
+			case VALUE_TYPE:
+				encoded.integer = value.annotation->val_type | value.annotation->obj_type << 8;
+				break;
+			case VALUE_REFERENCE: {
+				Collection::Obj_Header * header = Collection::header_of(value.reference.ptr);
+				if (!(header->flags & Collection::FLAG_PERMANENT) || header->kind != OBJ_TUPLE) {
+					fatal_internal("Only constant tuples can be cached");
+				}
+				encoded.integer = add_constant((Obj_Tuple*) value.reference.ptr);
+			} break;
+			default:
+				fatal_internal("Switch in Bytecode_Cache::Writer::encode() incomplete");
+				break;
+			}
+			return encoded;
+		}
+	};
+
+	bool write_all(int fd, const char * data, size_t length)
+	{
+		while (length > 0) {
+			ssize_t got = ::write(fd, data, length);
+			if (got < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			data += got;
+			length -= got;
+		}
+		return true;
+	}
+
+	/** save
+	 * Writes program (which must end in its halt) and the globals it
+	 * was compiled against. Goes through a temporary file and a
+	 * rename, so a reader never sees half a cache.
+	 */
+	void save(const char * cache_path, Source_Text * source,
+			  Instr * program, size_t program_length, Symbol_Table * globals)
+	{
+		Writer writer;
+		writer.alloc();
+
+		List<Instr> instrs;
+		instrs.alloc();
+		instrs.reserve(program_length);
+		for (size_t i = 0; i < program_length; i++) {
+			Instr instr = program[i];
+			instr.argument = writer.encode(instr.argument);
+			instrs.push(instr);
+		}
+		List<uint32_t> global_names;
+		global_names.alloc();
+		for (int i = 0; i < globals->symbols.size; i++) {
+			global_names.push(writer.add_string(globals->symbols[i]));
+		}
+
+		Header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, Bytecode_Cache::magic, sizeof(header.magic));
+		header.version = Bytecode_Cache::format_version;
+		header.instr_size = sizeof(Instr);
+		header.instr_kinds = INSTR_COUNT;
+		header.flags = current_flags();
+		header.source_hash = hash_source(source->data, source->length);
+		header.source_length = source->length;
+		header.string_count = writer.string_index.count;
+		header.global_count = global_names.size;
+		header.constant_count = writer.constant_index.count;
+		header.instr_count = instrs.size;
+		header.strings_offset = sizeof(Header);
+		header.globals_offset = header.strings_offset + writer.strings.length;
+		header.constants_offset = header.globals_offset + sizeof(uint32_t) * global_names.size;
+		size_t constants_end = header.constants_offset + writer.constants.length;
+		header.instrs_offset = (constants_end + 15) & ~(size_t) 15;
+		header.file_size = header.instrs_offset + sizeof(Instr) * instrs.size;
+
+		char * temp_path;
+		{
+			Sink sink;
+			sink.alloc();
+			sink.write(cache_path);
+			sink.write(".tmp.");
+			sink.write_int(getpid());
+			temp_path = sink.take_string();
+		}
+		int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd != -1) {
+			static const char padding[16] = {};
+			bool ok = write_all(fd, (const char*) &header, sizeof(header))
+				&& write_all(fd, writer.strings.buffer, writer.strings.length)
+				&& write_all(fd, (const char*) global_names.arr, sizeof(uint32_t) * global_names.size)
+				&& write_all(fd, writer.constants.buffer, writer.constants.length)
+				&& write_all(fd, padding, header.instrs_offset - constants_end)
+				&& write_all(fd, (const char*) instrs.arr, sizeof(Instr) * instrs.size);
+			close(fd);
+			if (!ok || rename(temp_path, cache_path) != 0) {
+				unlink(temp_path);
+			}
+		}
+		free(temp_path);
+		instrs.dealloc();
+		global_names.dealloc();
+		writer.dealloc();
+	}
+
+	/** Program
+	 * A cached program, loaded and ready to run. The instructions
+	 * live in the file's mapping.
+	 */
+	struct Program {
+		void * mapping;
+		size_t mapping_size;
+		Instr * instrs;
+		size_t instr_count;
+		void unload()
+		{
+			munmap(mapping, mapping_size);
+			mapping = NULL;
+			instrs = NULL;
+		}
+	};
+
+	struct Reader {
+		const uint8_t * base;
+		size_t size;
+		List<const char*> strings;
+		List<Value> constants;
+		bool decode(Value * value)
+		{
+			switch (value->type) {
+			case VALUE_INTEGER:
+				return true;
+			case VALUE_STRING: {
+				if (value->integer < 0 || value->integer >= strings.size) return false;
+				value->string = strings[value->integer];
+			} return true;
+			case VALUE_TYPE: {
+				int val_type = value->integer & 0xFF;
+				int obj_type = value->integer >> 8;
+				if (val_type < VALUE_PRIMITIVE_COUNT) {
+					value->annotation = Type_Annotation::primitive((Value_Type) val_type);
+				} else if (val_type == VALUE_REFERENCE && obj_type >= 0 &&
+						   obj_type < OBJ_BUILTIN_COUNT) {
+					value->annotation = Type_Annotation::reference((Obj_Type) obj_type);
+				} else {
+					return false;
+				}
+			} return true;
+			case VALUE_REFERENCE: {
+				if (value->integer < 0 || value->integer >= constants.size) return false;
+				*value = constants[value->integer];
+			} return true;
+			default:
+				return false;
+			}
+		}
+		bool read_strings(uint64_t offset, uint32_t count)
+		{
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t length;
+				if (offset + sizeof(length) > size) return false;
+				memcpy(&length, base + offset, sizeof(length));
+				offset += sizeof(length);
+				if (offset + length > size) return false;
+				strings.push(Intern::intern((const char*) base + offset, length));
+				offset += length;
+			}
+			return true;
+		}
+		bool read_constants(uint64_t offset, uint32_t count)
+		{
+			for (uint32_t i = 0; i < count; i++) {
+				uint64_t length;
+				if (offset + sizeof(length) > size) return false;
+				memcpy(&length, base + offset, sizeof(length));
+				offset += sizeof(length);
+				if (length > (size - offset) / sizeof(Value)) return false;
+				Obj_Tuple * tuple = Obj_Tuple::alloc_permanent(length);
+				memcpy(tuple->elements, base + offset, sizeof(Value) * length);
+				offset += sizeof(Value) * length;
+				for (uint64_t j = 0; j < length; j++) {
+					if (!decode(&tuple->elements[j])) return false;
+				}
+				constants.push(Value::make_reference(tuple));
+			}
+			return true;
+		}
+		// Declares the cached globals in the VM's table, which must
+		// only hold the builtins so far
+		bool read_globals(uint64_t offset, uint32_t count, Symbol_Table * globals)
+		{
+			if (offset + sizeof(uint32_t) * (uint64_t) count > size) return false;
+			if (count < globals->symbols.size) return false;
+			const uint8_t * names = base + offset;
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t name;
+				memcpy(&name, names + sizeof(uint32_t) * i, sizeof(name));
+				if (name >= strings.size) return false;
+				if (i < globals->symbols.size && globals->symbols[i] != strings[name]) {
+					return false;
+				}
+			}
+			for (uint32_t i = globals->symbols.size; i < count; i++) {
+				uint32_t name;
+				memcpy(&name, names + sizeof(uint32_t) * i, sizeof(name));
+				globals->declare(strings[name]);
+			}
+			return true;
+		}
+	};
+
+	/** check_program
+	 * Makes sure decoded instructions can't take the VM out of bounds:
+	 * every global slot is below global_count, every tuple length is
+	 * sane, and the op stack never underflows. Programs are
+	 * straight-line, so simulating the stack depth once covers every
+	 * run.
+	 */
+	bool check_program(Instr * instrs, uint32_t count, uint32_t global_count)
+	{
+		int64_t depth = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			Instr * instr = &instrs[i];
+			bool argument_is_slot = false;
+			bool operand_is_slot = false;
+			int64_t length = 0; // For tuple-making instructions
+			int64_t pops = 0;
+			int64_t pushes = 0;
+			switch (instr->type) {
+			case INSTR_HALT:
+				break;
+			case INSTR_POP_AND_DISCARD:
+			case INSTR_POP_AND_OUTPUT:
+				pops = 1;
+				break;
+			case INSTR_PUSH:
+				pushes = 1;
+				break;
+			case INSTR_MAKE_TUPLE:
+				length = instr->argument.integer;
+				pops = length;
+				pushes = 1;
+				break;
+			case INSTR_LOAD_GLOBAL:
+				argument_is_slot = true;
+				pushes = 1;
+				break;
+			case INSTR_DEFINE_GLOBAL:
+			case INSTR_STORE_GLOBAL:
+				argument_is_slot = true;
+				pops = 1;
+				break;
+			case INSTR_VALIDATE_TYPE:
+				pops = 2; // The type, and the value it checks
+				pushes = 1;
+				break;
+			case INSTR_TYPEOF:
+				pops = 1;
+				pushes = 1;
+				break;
+			case INSTR_PUSH_MAKE_TUPLE:
+				// The pushed value is the last element
+				length = instr->operand;
+				if (length < 1) return false;
+				pops = length - 1;
+				pushes = 1;
+				break;
+			case INSTR_LOAD_GLOBAL_2:
+				argument_is_slot = true;
+				operand_is_slot = true;
+				pushes = 2;
+				break;
+			case INSTR_VALIDATE_GLOBAL_TYPE:
+				argument_is_slot = true;
+				pops = 1;
+				pushes = 1;
+				break;
+			case INSTR_DEFINE_GLOBAL_CHECKED:
+				argument_is_slot = true;
+				operand_is_slot = true;
+				pops = 1;
+				break;
+			case INSTR_DEFINE_GLOBAL_CONST:
+			case INSTR_STORE_GLOBAL_CONST:
+				operand_is_slot = true;
+				break;
+			case INSTR_DEFINE_GLOBAL_COPY:
+			case INSTR_COPY_GLOBAL:
+				argument_is_slot = true;
+				operand_is_slot = true;
+				break;
+			case INSTR_MAKE_TUPLE_DEFINE_GLOBAL:
+			case INSTR_MAKE_TUPLE_STORE_GLOBAL:
+				length = instr->argument.integer;
+				operand_is_slot = true;
+				pops = length;
+				break;
+			case INSTR_OUTPUT_GLOBAL:
+				argument_is_slot = true;
+				break;
+			default:
+				return false;
+			}
+			if (argument_is_slot || instr->type == INSTR_MAKE_TUPLE ||
+				instr->type == INSTR_MAKE_TUPLE_DEFINE_GLOBAL ||
+				instr->type == INSTR_MAKE_TUPLE_STORE_GLOBAL) {
+				if (instr->argument.type != VALUE_INTEGER) return false;
+			}
+			if (argument_is_slot && (instr->argument.integer < 0 ||
+									 (uint32_t) instr->argument.integer >= global_count)) {
+				return false;
+			}
+			if (operand_is_slot && (instr->operand < 0 ||
+									(uint32_t) instr->operand >= global_count)) {
+				return false;
+			}
+			if (length < 0 || pops > depth) return false;
+			depth += pushes - pops;
+		}
+		// Every statement leaves the stack as it found it
+		return depth == 0;
+	}
+	/** load
+	 * Maps the cache for source and gets it ready to run against
+	 * globals. Returns false, having changed nothing, if there's no
+	 * usable cache.
+	 */
+	bool load(const char * cache_path, Source_Text * source,
+			  Symbol_Table * globals, Program * program)
+	{
+		int fd = open(cache_path, O_RDONLY);
+		if (fd == -1) return false;
+		struct stat info;
+		if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(Header)) {
+			close(fd);
+			return false;
+		}
+		size_t size = info.st_size;
+		// Private and writable, so patching the instructions never
+		// touches the file
+		void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return false;
+
+		Header header;
+		memcpy(&header, mapping, sizeof(header));
+		bool valid = memcmp(header.magic, Bytecode_Cache::magic, sizeof(header.magic)) == 0
+			&& header.version == Bytecode_Cache::format_version
+			&& header.instr_size == sizeof(Instr)
+			&& header.instr_kinds == INSTR_COUNT
+			&& header.flags == current_flags()
+			&& header.file_size == size
+			&& header.source_length == source->length
+			&& header.instrs_offset % 16 == 0
+			&& header.instr_count > 0
+			&& header.instrs_offset + sizeof(Instr) * (uint64_t) header.instr_count == size
+			&& header.source_hash == hash_source(source->data, source->length);
+		if (!valid) {
+			munmap(mapping, size);
+			return false;
+		}
+
+		// Nothing below can be undone, so the globals are checked and
+		// declared last, once everything else is known to be good
+		Reader reader;
+		reader.base = (const uint8_t*) mapping;
+		reader.size = size;
+		reader.strings.alloc();
+		reader.constants.alloc();
+		Instr * instrs = (Instr*) (reader.base + header.instrs_offset);
+		valid = reader.read_strings(header.strings_offset, header.string_count)
+			&& reader.read_constants(header.constants_offset, header.constant_count);
+		for (uint32_t i = 0; valid && i < header.instr_count; i++) {
+			valid = (uint32_t) instrs[i].type < INSTR_COUNT && reader.decode(&instrs[i].argument);
+		}
+		valid = valid && instrs[header.instr_count - 1].type == INSTR_HALT
+			&& check_program(instrs, header.instr_count, header.global_count)
+			&& reader.read_globals(header.globals_offset, header.global_count, globals);
+		reader.strings.dealloc();
+		reader.constants.dealloc();
+		if (!valid) {
+			// Any permanent tuples we made are simply never used
+			munmap(mapping, size);
+			return false;
+		}
+		program->mapping = mapping;
+		program->mapping_size = size;
+		program->instrs = instrs;
+		program->instr_count = header.instr_count;
+		return true;
+	}
+}
@@ -1,44 +1,256 @@
+/** Collection
+ * A generational mark-and-sweep collector. New objects go in the
+ * nursery; anything that survives a collection is promoted to the
+ * tenured generation. Minor collections only look at the nursery, and
+ * major collections look at everything.
+ *
+ * Every object is preceded by an Obj_Header, and lives in a cell
+ * handed out by Pool. Sweeping only sorts out which objects are dead;
+ * they're put on the doomed list, and Sweeper gives their cells back
+ * to Pool outside the pause.
+ *
+ * Constants the compiler builds ahead of time are permanent: they're
+ * never marked or swept, and live until the program exits.
+ *
+ * Objects are immutable once built, and an object is always built
+ * after everything it points to, so a tenured object can never point
+ * into the nursery. The only way for old data to reach young data is
+ * through a global binding, which the VM records in its remembered set
+ * with a write barrier.
+ */
 namespace Collection {
-	List<uint8_t*> ptrs;
+	enum {
+		FLAG_MARKED = 1 << 0,
+		FLAG_OLD    = 1 << 1,
+		FLAG_PERMANENT = 1 << 2,
+	};
+	/** Obj_Header
+	 * Sits directly in front of every managed object. Aligned so that
+	 * the object after it is aligned for anything.
+	 */
+	struct alignas(16) Obj_Header {
+		uint32_t size;      // Of the object, not counting the header
+		uint8_t flags;
+		uint8_t kind;       // An Obj_Type
+		uint8_t size_class; // Which Pool class the cell came from
+	};
+	static_assert(sizeof(Obj_Header) == 16, "Obj_Header should be 16 bytes");
+	Obj_Header * header_of(void * external_ptr)
+	{
+		return ((Obj_Header*) external_ptr) - 1;
+	}
+	List<Obj_Header*> nursery;
+	List<Obj_Header*> tenured;
+	List<Obj_Header*> permanent; // Only kept so they can be freed at exit
+	size_t nursery_bytes;
+	size_t tenured_bytes;
+	size_t major_threshold;
+	bool in_minor_collection;
+	// Marked objects whose children haven't been looked at yet
+	List<void*> gray;
+	// Dead objects found by the last sweep, for Sweeper to free
+	List<Obj_Header*> doomed;
+	// Running totals, for GC_Stats
+	size_t objects_allocated;
+	size_t bytes_allocated;
+	size_t cycle_bytes_freed; // By the collection in progress, or the last one
+	static constexpr size_t nursery_budget     = 1024 * 1024;
+	static constexpr size_t min_major_budget   = 8 * 1024 * 1024;
+	static constexpr size_t major_growth_factor = 2;
 	void init()
 	{
-		ptrs.alloc();
+		Pool::init();
+		nursery.alloc();
+		tenured.alloc();
+		permanent.alloc();
+		gray.alloc();
+		gray.shrinks = false;
+		doomed.alloc();
+		doomed.shrinks = false;
+		nursery_bytes = 0;
+		tenured_bytes = 0;
+		major_threshold = Collection::min_major_budget;
+		in_minor_collection = false;
+		objects_allocated = 0;
+		bytes_allocated = 0;
+		cycle_bytes_freed = 0;
+	}
+	size_t object_count()
+	{
+		return nursery.size + tenured.size;
+	}
+	// Whether the nursery has filled up
+	bool wants_collection()
+	{
+		return nursery_bytes >= Collection::nursery_budget;
+	}
+	// Whether the tenured generation has grown enough since the last
+	// major collection to be worth scanning again
+	bool wants_major_collection()
+	{
+		return tenured_bytes >= major_threshold;
+	}
+	Obj_Header * alloc_header(size_t size, uint8_t kind, uint8_t flags)
+	{
+		size_t cell_size = sizeof(Obj_Header) + size;
+		uint8_t size_class = Pool::size_class(cell_size);
+		Obj_Header * header = (Obj_Header*) Pool::alloc(cell_size, size_class);
+		header->size = size;
+		header->flags = flags;
+		header->kind = kind;
+		header->size_class = size_class;
+		return header;
+	}
+	void * alloc(size_t size, uint8_t kind)
+	{
+		nursery_bytes += size;
+		objects_allocated++;
+		bytes_allocated += size;
+		Obj_Header * header = alloc_header(size, kind, 0);
+		nursery.push(header);
+		return (void*) (header + 1);
+	}
+	/** alloc_permanent
+	 * Allocates an object that is never collected. It counts as old,
+	 * so storing it in a global doesn't need remembering. It must only
+	 * ever point to other permanent objects.
+	 */
+	void * alloc_permanent(size_t size, uint8_t kind)
+	{
+		Obj_Header * header = alloc_header(size, kind, FLAG_OLD | FLAG_PERMANENT);
+		permanent.push(header);
+		return (void*) (header + 1);
+	}
+	bool is_young(void * external_ptr)
+	{
+		return !(header_of(external_ptr)->flags & FLAG_OLD);
+	}
+	/** mark_ptr
+	 * Marks an object, and returns whether the caller should go on to
+	 * mark whatever the object points to --- only the first time it's
+	 * marked. During a minor collection tenured objects are left
+	 * alone, since nothing they point to can be young. Permanent
+	 * objects are never marked at all.
+	 */
+	bool mark_ptr(void * external_ptr)
+	{
+		Obj_Header * header = header_of(external_ptr);
+		if (header->flags & (FLAG_PERMANENT | FLAG_MARKED)) {
+			return false;
+		}
+		if (in_minor_collection && (header->flags & FLAG_OLD)) {
+			return false;
+		}
+		header->flags |= FLAG_MARKED;
+		return true;
 	}
-	void * alloc(size_t size)
+	// mark_ptr() for when several threads are marking at once. Only
+	// one of them gets true for any object.
+	bool mark_ptr_atomic(void * external_ptr)
 	{
-		uint8_t * raw_ptr = (uint8_t*) malloc(size + 1);
-		*raw_ptr = 0;
-		ptrs.push(raw_ptr);
-		return (void*) (raw_ptr + 1);
+		Obj_Header * header = header_of(external_ptr);
+		uint8_t flags = __atomic_load_n(&header->flags, __ATOMIC_RELAXED);
+		if (flags & (FLAG_PERMANENT | FLAG_MARKED)) {
+			return false;
+		}
+		if (in_minor_collection && (flags & FLAG_OLD)) {
+			return false;
+		}
+		uint8_t old = __atomic_fetch_or(&header->flags, (uint8_t) FLAG_MARKED, __ATOMIC_RELAXED);
+		return !(old & FLAG_MARKED);
 	}
-	void unmark_all()
+	// Marks an object and queues it to have its children marked
+	void shade(void * external_ptr)
 	{
-		for (int i = 0; i < ptrs.size; i++) {
-			*(ptrs[i]) = 0;
+		if (mark_ptr(external_ptr)) {
+			gray.push(external_ptr);
 		}
 	}
-	void mark_ptr(void * external_ptr)
+	void begin_minor_collection()
+	{
+		in_minor_collection = true;
+		cycle_bytes_freed = 0;
+	}
+	void begin_major_collection()
 	{
-		uint8_t * raw_ptr = ((uint8_t*) external_ptr) - 1;
-		*raw_ptr = 1;
+		in_minor_collection = false;
+		cycle_bytes_freed = 0;
 	}
-	void collect_unmarked()
+	// Dooms unmarked objects in the nursery and promotes the rest
+	void sweep_nursery()
 	{
-		List<uint8_t*> new_ptrs;
-		new_ptrs.alloc();
-		for (int i = 0; i < ptrs.size; i++) {
-			if (*(ptrs[i])) {
-				new_ptrs.push(ptrs[i]);
+		for (int i = 0; i < nursery.size; i++) {
+			Obj_Header * header = nursery[i];
+			if (header->flags & FLAG_MARKED) {
+				header->flags = FLAG_OLD;
+				tenured.push(header);
+				tenured_bytes += header->size;
+			} else {
+				cycle_bytes_freed += header->size;
+				doomed.push(header);
 			}
 		}
-		ptrs.dealloc();
-		ptrs = new_ptrs;
+		nursery.clear();
+		nursery_bytes = 0;
+		in_minor_collection = false;
+	}
+	// Must run before sweep_nursery(), or freshly promoted objects
+	// would be mistaken for unmarked tenured ones
+	void sweep_tenured()
+	{
+		size_t kept = 0;
+		tenured_bytes = 0;
+		for (int i = 0; i < tenured.size; i++) {
+			Obj_Header * header = tenured[i];
+			if (header->flags & FLAG_MARKED) {
+				header->flags = FLAG_OLD;
+				tenured[kept++] = header;
+				tenured_bytes += header->size;
+			} else {
+				cycle_bytes_freed += header->size;
+				doomed.push(header);
+			}
+		}
+		tenured.size = kept;
+	}
+	// Sets the budget for the next major collection based on how
+	// much survived this one
+	void end_major_collection()
+	{
+		major_threshold = tenured_bytes * Collection::major_growth_factor;
+		if (major_threshold < Collection::min_major_budget) {
+			major_threshold = Collection::min_major_budget;
+		}
 	}
 	void destroy_everything()
 	{
-		for (int i = 0; i < ptrs.size; i++) {
-			free(ptrs[i]);
+		// Pooled cells go away with their chunks, but large objects
+		// were malloc'd one by one
+		for (int i = 0; i < nursery.size; i++) {
+			if (nursery[i]->size_class == Pool::large_class) {
+				Pool::release(nursery[i], Pool::large_class);
+			}
+		}
+		for (int i = 0; i < tenured.size; i++) {
+			if (tenured[i]->size_class == Pool::large_class) {
+				Pool::release(tenured[i], Pool::large_class);
+			}
+		}
+		for (int i = 0; i < permanent.size; i++) {
+			if (permanent[i]->size_class == Pool::large_class) {
+				Pool::release(permanent[i], Pool::large_class);
+			}
+		}
+		for (int i = 0; i < doomed.size; i++) {
+			if (doomed[i]->size_class == Pool::large_class) {
+				Pool::release(doomed[i], Pool::large_class);
+			}
 		}
-		ptrs.dealloc();
+		nursery.dealloc();
+		tenured.dealloc();
+		permanent.dealloc();
+		gray.dealloc();
+		doomed.dealloc();
+		Pool::destroy_everything();
 	}
 }
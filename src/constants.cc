@@ -0,0 +1,44 @@
+/** Constants
+ * Folds expressions made only of literals into values at compile
+ * time. A literal tuple becomes a permanent object, so it's built once
+ * instead of on every execution and the collector never looks at it.
+ * That's only sound because tuples are immutable.
+ */
+namespace Constants {
+	bool is_constant(Expr * expr)
+	{
+		switch (expr->type) {
+		case EXPR_INTEGER:
+		case EXPR_STRING:
+			return true;
+		case EXPR_TUPLE: {
+			for (int i = 0; i < expr->tuple.size; i++) {
+				if (!is_constant(expr->tuple[i])) return false;
+			}
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+	// expr must satisfy is_constant()
+	Value materialize(Expr * expr)
+	{
+		switch (expr->type) {
+		case EXPR_INTEGER:
+			return Value::make_integer(expr->integer);
+		case EXPR_STRING:
+			return Value::make_string_from_intern(expr->string);
+		case EXPR_TUPLE: {
+			Obj_Tuple * tuple = Obj_Tuple::alloc_permanent(expr->tuple.size);
+			for (int i = 0; i < expr->tuple.size; i++) {
+				tuple->elements[i] = materialize(expr->tuple[i]);
+			}
+			return Value::make_reference(tuple);
+		}
+		default:
+			fatal_internal("Constants::materialize() called on a non-constant");
+			return Value::make_integer(0);
+		}
+	}
+}
@@ -0,0 +1,99 @@
+/** Disassembler
+ * Writes stack bytecode out as text, one instruction per line, with
+ * global slots shown by name. Used by --disasm.
+ */
+namespace Disassembler {
+	void write_slot(Sink * sink, Symbol_Table * globals, int slot)
+	{
+		if (slot >= 0 && slot < globals->symbols.size) {
+			sink->write(globals->symbols[slot]);
+		} else {
+			sink->write("<slot ");
+			sink->write_int(slot);
+			sink->put('>');
+		}
+	}
+	// Quotes strings, so that they can't be mistaken for symbols
+	void write_constant(Sink * sink, Value value)
+	{
+		if (value.type == VALUE_STRING) {
+			sink->put('"');
+			sink->write(value.string);
+			sink->put('"');
+		} else {
+			value.print_to(sink);
+		}
+	}
+	bool has_operands(Instr_Type type)
+	{
+		switch (type) {
+		case INSTR_HALT:
+		case INSTR_POP_AND_DISCARD:
+		case INSTR_POP_AND_OUTPUT:
+		case INSTR_VALIDATE_TYPE:
+		case INSTR_TYPEOF:
+			return false;
+		default:
+			return true;
+		}
+	}
+	void write_operands(Sink * sink, Instr * instr, Symbol_Table * globals)
+	{
+		switch (instr->type) {
+		case INSTR_PUSH:
+			write_constant(sink, instr->argument);
+			break;
+		case INSTR_MAKE_TUPLE:
+			sink->write_int(instr->argument.integer);
+			break;
+		case INSTR_LOAD_GLOBAL:
+		case INSTR_DEFINE_GLOBAL:
+		case INSTR_STORE_GLOBAL:
+		case INSTR_VALIDATE_GLOBAL_TYPE:
+		case INSTR_OUTPUT_GLOBAL:
+			write_slot(sink, globals, instr->argument.integer);
+			break;
+		case INSTR_LOAD_GLOBAL_2:
+		case INSTR_DEFINE_GLOBAL_CHECKED:
+		case INSTR_DEFINE_GLOBAL_COPY:
+		case INSTR_COPY_GLOBAL:
+			write_slot(sink, globals, instr->argument.integer);
+			sink->write(", ");
+			write_slot(sink, globals, instr->operand);
+			break;
+		case INSTR_PUSH_MAKE_TUPLE:
+			write_constant(sink, instr->argument);
+			sink->write(", ");
+			sink->write_int(instr->operand);
+			break;
+		case INSTR_DEFINE_GLOBAL_CONST:
+		case INSTR_STORE_GLOBAL_CONST:
+			write_constant(sink, instr->argument);
+			sink->write(", ");
+			write_slot(sink, globals, instr->operand);
+			break;
+		case INSTR_MAKE_TUPLE_DEFINE_GLOBAL:
+		case INSTR_MAKE_TUPLE_STORE_GLOBAL:
+			sink->write_int(instr->argument.integer);
+			sink->write(", ");
+			write_slot(sink, globals, instr->operand);
+			break;
+		default:
+			break;
+		}
+	}
+	// Each program is followed by a blank line
+	void disassemble(Instr * program, size_t length, Symbol_Table * globals, Sink * sink)
+	{
+		char buf[64];
+		for (size_t i = 0; i < length; i++) {
+			const char * format = has_operands(program[i].type) ? "%04zu  %-26s" : "%04zu  %s";
+			sink->write(buf, snprintf(buf, sizeof(buf), format, i,
+									  instr_names[program[i].type]));
+			write_operands(sink, &program[i], globals);
+			sink->put('\n');
+		}
+		sink->put('\n');
+		sink->flush();
+	}
+}
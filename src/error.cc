@@ -15,14 +15,18 @@
 #define INVERTED(x) SET_INVERTED x RESET
 #define RED(x)  SET_RED x RESET
 
+// Called before an error aborts, e.g. to get buffered output out
+void (*before_fatal)() = NULL;
+
 void fatal(const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
 
+	if (before_fatal) before_fatal();
 	fprintf(stderr, RED(BOLD("encountered error")) ":\n");
 	vfprintf(stderr, fmt, args);
-	printf("\n");
+	fprintf(stderr, "\n");
 
 	va_end(args);
 	//exit(1);
@@ -34,10 +38,11 @@ void _fatal_internal(const char * fmt, const char * file, size_t line, ...)
 	va_list args;
 	va_start(args, line);
 
+	if (before_fatal) before_fatal();
 	fprintf(stderr, INVERTED(RED(BOLD("internal error"))) ":\n");
 	fprintf(stderr, DIM("%s:%zu") "\n", file, line);
 	vfprintf(stderr, fmt, args);
-	printf("\n");
+	fprintf(stderr, "\n");
 
 	va_end(args);
 	abort();
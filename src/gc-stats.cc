@@ -0,0 +1,198 @@
+/** GC_Stats
+ * Records what every collection did and how long it took, for sizing
+ * the heap and tuning the budgets in Collection. Nothing is written
+ * unless asked for: --gc-stats prints a summary at exit, and
+ * --gc-trace=path writes one JSON line per cycle and a final summary
+ * line.
+ */
+namespace GC_Stats {
+	struct Cycle {
+		size_t number;
+		bool major;
+		uint64_t pause_ns;
+		uint64_t mark_ns;
+		uint64_t sweep_ns;
+		size_t objects_allocated; // Since the previous cycle
+		size_t bytes_allocated;
+		size_t objects_before;
+		size_t bytes_before;
+		size_t objects_freed;
+		size_t bytes_freed;
+		size_t objects_survived; // Everything left afterwards
+		size_t bytes_survived;
+	};
+	// Bucket i counts pauses under 2^i microseconds; the last one
+	// counts everything longer
+	static constexpr int histogram_buckets = 24;
+
+	bool summary = false;
+	bool tracing = false;
+	Sink trace;
+	size_t cycles;
+	size_t major_cycles;
+	uint64_t total_pause_ns;
+	uint64_t max_pause_ns;
+	uint64_t total_mark_ns;
+	uint64_t total_sweep_ns;
+	size_t total_objects_freed;
+	size_t total_bytes_freed;
+	size_t histogram[GC_Stats::histogram_buckets];
+	// Allocation totals as of the last cycle
+	size_t last_objects_allocated;
+	size_t last_bytes_allocated;
+
+	uint64_t clock_ns()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	// Returns false if the trace file can't be opened
+	bool init(bool summary, const char * trace_path)
+	{
+		GC_Stats::summary = summary;
+		cycles = major_cycles = 0;
+		total_pause_ns = max_pause_ns = total_mark_ns = total_sweep_ns = 0;
+		total_objects_freed = total_bytes_freed = 0;
+		last_objects_allocated = last_bytes_allocated = 0;
+		memset(histogram, 0, sizeof(histogram));
+		if (trace_path) {
+			int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1) return false;
+			trace.alloc(fd);
+			tracing = true;
+		}
+		return true;
+	}
+	int bucket_for(uint64_t pause_ns)
+	{
+		uint64_t micros = pause_ns / 1000;
+		int bucket = 0;
+		while (bucket < GC_Stats::histogram_buckets - 1 && micros >= ((uint64_t) 1 << bucket)) {
+			bucket++;
+		}
+		return bucket;
+	}
+	// Fills in the fields that come from the collector's counters
+	void begin_cycle(Cycle * cycle, bool major)
+	{
+		cycle->number = cycles;
+		cycle->major = major;
+		cycle->objects_allocated = Collection::objects_allocated - last_objects_allocated;
+		cycle->bytes_allocated = Collection::bytes_allocated - last_bytes_allocated;
+		cycle->objects_before = Collection::object_count();
+		cycle->bytes_before = Collection::nursery_bytes + Collection::tenured_bytes;
+		last_objects_allocated = Collection::objects_allocated;
+		last_bytes_allocated = Collection::bytes_allocated;
+	}
+	void write_trace_line(Cycle * cycle)
+	{
+		char buf[512];
+		trace.write(buf, snprintf(
+			buf, sizeof(buf),
+			"{\"cycle\":%zu,\"kind\":\"%s\",\"pause_us\":%.3f,\"mark_us\":%.3f,"
+			"\"sweep_us\":%.3f,\"objects_allocated\":%zu,\"bytes_allocated\":%zu,"
+			"\"objects_before\":%zu,\"bytes_before\":%zu,\"objects_freed\":%zu,"
+			"\"bytes_freed\":%zu,\"objects_survived\":%zu,\"bytes_survived\":%zu,"
+			"\"major_threshold\":%zu}\n",
+			cycle->number, cycle->major ? "major" : "minor", cycle->pause_ns / 1e3,
+			cycle->mark_ns / 1e3, cycle->sweep_ns / 1e3, cycle->objects_allocated,
+			cycle->bytes_allocated, cycle->objects_before, cycle->bytes_before,
+			cycle->objects_freed, cycle->bytes_freed, cycle->objects_survived,
+			cycle->bytes_survived, Collection::major_threshold));
+	}
+	void end_cycle(Cycle * cycle)
+	{
+		cycle->objects_freed = cycle->objects_before - Collection::object_count();
+		cycle->bytes_freed = Collection::cycle_bytes_freed;
+		cycle->objects_survived = Collection::object_count();
+		cycle->bytes_survived = Collection::nursery_bytes + Collection::tenured_bytes;
+		cycles++;
+		if (cycle->major) major_cycles++;
+		total_pause_ns += cycle->pause_ns;
+		total_mark_ns += cycle->mark_ns;
+		total_sweep_ns += cycle->sweep_ns;
+		if (cycle->pause_ns > max_pause_ns) max_pause_ns = cycle->pause_ns;
+		total_objects_freed += cycle->objects_freed;
+		total_bytes_freed += cycle->bytes_freed;
+		histogram[bucket_for(cycle->pause_ns)]++;
+		if (tracing) write_trace_line(cycle);
+	}
+	void write_histogram_json(Sink * sink)
+	{
+		sink->put('[');
+		for (int i = 0; i < GC_Stats::histogram_buckets; i++) {
+			if (i > 0) sink->put(',');
+			sink->write_int(histogram[i]);
+		}
+		sink->put(']');
+	}
+	void write_summary_json(Sink * sink)
+	{
+		char buf[512];
+		sink->write(buf, snprintf(
+			buf, sizeof(buf),
+			"{\"summary\":true,\"cycles\":%zu,\"major_cycles\":%zu,"
+			"\"total_pause_us\":%.3f,\"max_pause_us\":%.3f,\"total_mark_us\":%.3f,"
+			"\"total_sweep_us\":%.3f,\"objects_allocated\":%zu,\"bytes_allocated\":%zu,"
+			"\"objects_freed\":%zu,\"bytes_freed\":%zu,\"objects_live\":%zu,"
+			"\"bytes_live\":%zu,\"pause_histogram_log2_us\":",
+			cycles, major_cycles, total_pause_ns / 1e3, max_pause_ns / 1e3,
+			total_mark_ns / 1e3, total_sweep_ns / 1e3, Collection::objects_allocated,
+			Collection::bytes_allocated, total_objects_freed, total_bytes_freed,
+			Collection::object_count(), Collection::nursery_bytes + Collection::tenured_bytes));
+		write_histogram_json(sink);
+		sink->write("}\n");
+	}
+	void write_summary(Sink * sink)
+	{
+		char buf[256];
+		sink->write("== GC summary ==\n");
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "cycles         %zu (%zu major, %zu minor)\n",
+								  cycles, major_cycles, cycles - major_cycles));
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "pause          %.3f ms total, %.3f ms max, %.3f ms mean\n",
+								  total_pause_ns / 1e6, max_pause_ns / 1e6,
+								  cycles ? total_pause_ns / 1e6 / cycles : 0.0));
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "mark / sweep   %.3f ms / %.3f ms\n",
+								  total_mark_ns / 1e6, total_sweep_ns / 1e6));
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "allocated      %zu objects, %zu bytes\n",
+								  Collection::objects_allocated, Collection::bytes_allocated));
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "freed          %zu objects, %zu bytes\n",
+								  total_objects_freed, total_bytes_freed));
+		sink->write(buf, snprintf(buf, sizeof(buf),
+								  "live at exit   %zu objects, %zu bytes\n",
+								  Collection::object_count(),
+								  Collection::nursery_bytes + Collection::tenured_bytes));
+		if (cycles > 0) {
+			sink->write("pause histogram\n");
+			for (int i = 0; i < GC_Stats::histogram_buckets; i++) {
+				if (histogram[i] == 0) continue;
+				if (i == GC_Stats::histogram_buckets - 1) {
+					sink->write(buf, snprintf(buf, sizeof(buf), "  >= %8llu us  %zu\n",
+											  1ull << (i - 1), histogram[i]));
+				} else {
+					sink->write(buf, snprintf(buf, sizeof(buf), "   < %8llu us  %zu\n",
+											  1ull << i, histogram[i]));
+				}
+			}
+		}
+		sink->flush();
+	}
+	// Writes whatever was asked for. Called once, at exit.
+	void finish(Sink * diagnostics)
+	{
+		if (summary) write_summary(diagnostics);
+		if (tracing) {
+			write_summary_json(&trace);
+			int fd = trace.fd;
+			trace.dealloc(); // Flushes
+			close(fd);
+			tracing = false;
+		}
+	}
+}
@@ -1,24 +1,88 @@
+/** Intern
+ * Every symbol and string literal is interned, so that equal strings
+ * share one pointer and can be compared with ==. The strings
+ * themselves live in one arena; lookup goes through an
+ * open-addressing hash table keyed by (hash, length).
+ */
 namespace Intern {
-	List<const char*> interns;
+	struct Entry {
+		uint32_t hash;
+		uint32_t length;
+		const char * string; // NULL for an empty slot
+	};
+	Arena strings;
+	Entry * table;
+	size_t table_capacity; // Always a power of two
+	size_t table_count;
+	static constexpr size_t initial_capacity = 1024;
+	static constexpr float  max_load         = 0.5;
+
+	uint32_t hash_bytes(const char * s, size_t length)
+	{
+		// FNV-1a
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < length; i++) {
+			hash ^= (uint8_t) s[i];
+			hash *= 16777619u;
+		}
+		return hash;
+	}
 	void init()
 	{
-		interns.alloc();
+		strings.alloc();
+		table_capacity = Intern::initial_capacity;
+		table_count = 0;
+		table = (Entry*) calloc(table_capacity, sizeof(Entry));
 	}
 	void destroy_everything()
 	{
-		for (int i = 0; i < interns.size; i++) {
-			free((void*) interns[i]);
+		strings.dealloc();
+		free(table);
+		table = NULL;
+		table_capacity = 0;
+		table_count = 0;
+	}
+	void grow_table()
+	{
+		size_t new_capacity = table_capacity * 2;
+		Entry * new_table = (Entry*) calloc(new_capacity, sizeof(Entry));
+		for (size_t i = 0; i < table_capacity; i++) {
+			Entry entry = table[i];
+			if (!entry.string) continue;
+			size_t slot = entry.hash & (new_capacity - 1);
+			while (new_table[slot].string) {
+				slot = (slot + 1) & (new_capacity - 1);
+			}
+			new_table[slot] = entry;
 		}
-		interns.dealloc();
+		free(table);
+		table = new_table;
+		table_capacity = new_capacity;
 	}
-	const char * intern(const char * s)
+	const char * intern(const char * s, size_t length)
 	{
-		for (int i = 0; i < interns.size; i++) {
-			if (strcmp(s, interns[i]) == 0) {
-				return interns[i];
+		uint32_t hash = hash_bytes(s, length);
+		size_t slot = hash & (table_capacity - 1);
+		while (table[slot].string) {
+			Entry entry = table[slot];
+			if (entry.hash == hash && entry.length == length &&
+				memcmp(entry.string, s, length) == 0) {
+				return entry.string;
 			}
+			slot = (slot + 1) & (table_capacity - 1);
+		}
+		char * copy = (char*) strings.push(length + 1, 1);
+		memcpy(copy, s, length);
+		copy[length] = '\0';
+		table[slot] = (Entry) { hash, (uint32_t) length, copy };
+		table_count++;
+		if (table_count > table_capacity * Intern::max_load) {
+			grow_table();
 		}
-		interns.push(strdup(s));
-		return interns[interns.size - 1];
+		return copy;
+	}
+	const char * intern(const char * s)
+	{
+		return intern(s, strlen(s));
 	}
 }
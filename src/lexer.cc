@@ -17,10 +17,77 @@ enum Token_Type {
 #define RESERVED_WORDS_END   (TOKEN_SYMBOL)
 #define RESERVED_WORDS_COUNT (RESERVED_WORDS_END - RESERVED_WORDS_BEGIN)
 
-static const char * reserved_words[RESERVED_WORDS_COUNT] = {
+static constexpr const char * reserved_words[RESERVED_WORDS_COUNT] = {
 	"let", "set", "print", "typeof", "product",
 };
 
+/* Reserved words are recognized with a perfect hash: the length plus
+ * the first character, mod 16, is different for every one of them
+ * (checked below at compile time). A candidate identifier then needs
+ * at most one memcmp.
+ */
+constexpr size_t reserved_word_hash(const char * s, size_t length)
+{
+	return (length + (uint8_t) s[0]) & 15;
+}
+
+struct Reserved_Word_Table {
+	int8_t index[16]; // Into reserved_words, or -1
+	bool is_perfect;
+	constexpr Reserved_Word_Table(const char * const * words, int count)
+		: index(), is_perfect(true)
+	{
+		for (int i = 0; i < 16; i++) index[i] = -1;
+		for (int i = 0; i < count; i++) {
+			size_t length = 0;
+			while (words[i][length]) length++;
+			size_t h = reserved_word_hash(words[i], length);
+			if (index[h] != -1) is_perfect = false;
+			index[h] = i;
+		}
+	}
+};
+
+static constexpr Reserved_Word_Table reserved_word_table(reserved_words,
+														 RESERVED_WORDS_COUNT);
+static_assert(reserved_word_table.is_perfect,
+			  "Reserved word hash collides; pick a new reserved_word_hash()");
+
+// Character classes, so each byte is classified with one table load
+enum {
+	CHAR_SPACE       = 1 << 0,
+	CHAR_IDENT_START = 1 << 1, // Letters and _
+	CHAR_IDENT       = 1 << 2, // Letters, digits and _
+	CHAR_DIGIT       = 1 << 3,
+};
+
+struct Char_Class_Table {
+	uint8_t classes[256];
+	constexpr Char_Class_Table() : classes()
+	{
+		for (int c = 0; c < 256; c++) {
+			uint8_t cls = 0;
+			if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') {
+				cls |= CHAR_SPACE;
+			}
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
+				cls |= CHAR_IDENT_START | CHAR_IDENT;
+			}
+			if (c >= '0' && c <= '9') {
+				cls |= CHAR_DIGIT | CHAR_IDENT;
+			}
+			classes[c] = cls;
+		}
+	}
+};
+
+static constexpr Char_Class_Table char_classes;
+
+inline bool char_is(char c, uint8_t cls)
+{
+	return char_classes.classes[(uint8_t) c] & cls;
+}
+
 struct Token {
 	Token_Type type;
 	union {
@@ -99,18 +166,20 @@ struct Lexer {
 	const char * source;
 	size_t source_length;
 	size_t cursor;
-	Lexer(const char * source);
+	Lexer(const char * source, size_t source_length);
 	char next();
 	char peek();
 	void advance();
+	void skip_whitespace_and_comments();
 	Token next_token();
 	Token_Type read_double_token(char left, char right, Token_Type double_type);
 };
 
-Lexer::Lexer(const char * source)
+// source doesn't need to be NUL-terminated
+Lexer::Lexer(const char * source, size_t source_length)
 {
 	this->source = source;
-	source_length = strlen(source);
+	this->source_length = source_length;
 	cursor = 0;
 }
 
@@ -134,67 +203,81 @@ void Lexer::advance()
 	cursor++;
 }
 
+// Comments run from // to the end of the line
+void Lexer::skip_whitespace_and_comments()
+{
+	const char * p = source + cursor;
+	const char * end = source + source_length;
+	while (p < end) {
+		if (char_is(*p, CHAR_SPACE)) {
+			p++;
+		} else if (*p == '/' && p + 1 < end && p[1] == '/') {
+			const char * newline = (const char*) memchr(p, '\n', end - p);
+			p = newline ? newline + 1 : end;
+		} else {
+			break;
+		}
+	}
+	cursor = p - source;
+}
+
 Token Lexer::next_token()
 {
- reset:
-	if (peek() == '\0') {
+	skip_whitespace_and_comments();
+	if (cursor >= source_length) {
 		return Token::eof();
 	}
-	
-	if (isspace(peek())) {
-		advance();
-		goto reset;
-	}
 
-	if (peek() == '"') {
-		advance();
-		// TODO(pixlark): Buffer overflow
-		char buf[512];
-		size_t i = 0;
-		while (peek() != '"') {
-			buf[i++] = next();
+	const char * start = source + cursor;
+	const char * end = source + source_length;
+
+	if (*start == '"') {
+		start++;
+		const char * close = (const char*) memchr(start, '"', end - start);
+		if (!close) {
+			fatal("Unterminated string literal");
 		}
-		buf[i++] = '\0';
-		advance();
+		cursor = (close + 1) - source;
 		
 		Token token;
 		token.type = TOKEN_STRING_LITERAL;
-		token.values.string = Intern::intern(buf);
+		token.values.string = Intern::intern(start, close - start);
 		return token;
 	}
 	
-	if (isalpha(peek()) || peek() == '_') {
-		// TODO(pixlark): Buffer overflow
-		char buf[512];
-		size_t i = 0;
-		while (isalnum(peek()) || peek() == '_') {
-			buf[i++] = next();
-		}
-		buf[i++] = '\0';
+	if (char_is(*start, CHAR_IDENT_START)) {
+		const char * p = start + 1;
+		while (p < end && char_is(*p, CHAR_IDENT)) p++;
+		size_t length = p - start;
+		cursor = p - source;
 
-		for (int i = 0; i < RESERVED_WORDS_COUNT; i++) {
-			if (strcmp(buf, reserved_words[i]) == 0) {
-				return Token::with_type((Token_Type) (RESERVED_WORDS_BEGIN + i));
-			}
+		int reserved = reserved_word_table.index[reserved_word_hash(start, length)];
+		if (reserved != -1 &&
+			strncmp(reserved_words[reserved], start, length) == 0 &&
+			reserved_words[reserved][length] == '\0') {
+			return Token::with_type((Token_Type) (RESERVED_WORDS_BEGIN + reserved));
 		}
 		
 		Token token;
 		token.type = TOKEN_SYMBOL;
-		token.values.symbol = Intern::intern(buf);
+		token.values.symbol = Intern::intern(start, length);
 		return token;
 	}
 
-	if (isdigit(peek())) {
-		// TODO(pixlark): Buffer overflow
-		char buf[512];
-		size_t i = 0;
-		while (isdigit(peek())) {
-			buf[i++] = next();
+	if (char_is(*start, CHAR_DIGIT)) {
+		const char * p = start;
+		int64_t value = 0;
+		while (p < end && char_is(*p, CHAR_DIGIT)) {
+			value = value * 10 + (*p - '0');
+			if (value > INT32_MAX) {
+				fatal("Integer literal is too large");
+			}
+			p++;
 		}
-		buf[i++] = '\0';
+		cursor = p - source;
 		Token token;
 		token.type = TOKEN_INTEGER_LITERAL;
-		token.values.integer = strtol(buf, NULL, 10);
+		token.values.integer = (int) value;
 		return token;
 	}
 	
@@ -1,12 +1,22 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "list.h" // Necessary evil
 
@@ -14,28 +24,78 @@
 #include "utility.cc"
 #include "error.cc"
 #include "string-builder.cc"
+#include "sink.cc"
+#include "timings.cc"
+#include "arena.cc"
 #include "intern.cc"
 #include "lexer.cc"
+#include "pool.cc"
 #include "collection.cc"
+#include "sweeper.cc"
+#include "gc-stats.cc"
 #include "value.cc"
+#include "parallel-mark.cc"
 #include "parser.cc"
-#include "ast-deallocation.cc"
 #include "symbol-table.cc"
+#include "type-check.cc"
+#include "constants.cc"
+#include "profiler.cc"
+
+/* Threaded dispatch uses GCC's labels-as-values extension, which
+ * clang also understands. Build with -DMARCH_THREADED_DISPATCH=0 to
+ * get the plain switch loop instead.
+ */
+#ifndef MARCH_THREADED_DISPATCH
+#  ifdef __GNUC__
+#    define MARCH_THREADED_DISPATCH 1
+#  else
+#    define MARCH_THREADED_DISPATCH 0
+#  endif
+#endif
+
+// Every instruction, in opcode order. The dispatch table in VM::run()
+// is generated from this, so the two can never get out of sync.
+#define INSTR_LIST(X)							\
+	X(INSTR_HALT)								\
+	X(INSTR_POP_AND_DISCARD)					\
+	X(INSTR_POP_AND_OUTPUT)						\
+	X(INSTR_PUSH)								\
+	X(INSTR_MAKE_TUPLE)							\
+	X(INSTR_LOAD_GLOBAL)						\
+	X(INSTR_DEFINE_GLOBAL)						\
+	X(INSTR_STORE_GLOBAL)						\
+	X(INSTR_VALIDATE_TYPE)						\
+	X(INSTR_TYPEOF)								\
+	/* Superinstructions, only made by Peephole */ \
+	X(INSTR_PUSH_MAKE_TUPLE)        /* push argument, make an operand-tuple */ \
+	X(INSTR_LOAD_GLOBAL_2)          /* load argument, then load operand */ \
+	X(INSTR_VALIDATE_GLOBAL_TYPE)   /* check top against global argument */ \
+	X(INSTR_DEFINE_GLOBAL_CHECKED)  /* ...and define global operand */ \
+	X(INSTR_DEFINE_GLOBAL_CONST)    /* define global operand as argument */ \
+	X(INSTR_DEFINE_GLOBAL_COPY)     /* define global operand as global argument */ \
+	X(INSTR_MAKE_TUPLE_DEFINE_GLOBAL) /* make an argument-tuple, define global operand */ \
+	X(INSTR_MAKE_TUPLE_STORE_GLOBAL) /* make an argument-tuple into global operand */ \
+	X(INSTR_COPY_GLOBAL)            /* store global argument into global operand */ \
+	X(INSTR_STORE_GLOBAL_CONST)     /* store argument into global operand */ \
+	X(INSTR_OUTPUT_GLOBAL)          /* print global argument */
 
 enum Instr_Type {
-	INSTR_POP_AND_DISCARD,
-	INSTR_POP_AND_OUTPUT,
-	INSTR_POP_AND_LOOKUP,
-	INSTR_PUSH,
-	INSTR_MAKE_TUPLE,
-	INSTR_BIND,
-	INSTR_VALIDATE_TYPE,
-	INSTR_UPDATE_BINDING,
-	INSTR_TYPEOF,
+#define X(name) name,
+	INSTR_LIST(X)
+#undef X
+	INSTR_COUNT,
+};
+
+// Without the INSTR_ prefix
+static const char * const instr_names[INSTR_COUNT] = {
+#define X(name) #name + 6,
+	INSTR_LIST(X)
+#undef X
 };
 
 struct Instr {
 	Instr_Type type;
+	int operand; // Second operand of a superinstruction; fits in padding
 	union {
 		Value argument;
 	};
@@ -46,20 +106,46 @@ struct Instr {
 	static Instr with_type_and_arg(Instr_Type type,
 								   Value argument)
 	{
-		return (Instr) { type, argument };
+		return (Instr) { type, 0, argument };
+	}
+	static Instr with_operands(Instr_Type type,
+							   Value argument, int operand)
+	{
+		return (Instr) { type, operand, argument };
 	}
 };
+static_assert(sizeof(Instr) == 24, "Instr should stay 24 bytes");
+
+#include "peephole.cc" // Needs Instr
+#include "disassembler.cc" // Needs Instr
+
+struct VM;
 
 struct Compiler {
 	List<Instr> source;
-	void alloc()
+	Symbol_Table * globals; // Owned by the VM; we only hand out slots
+	void alloc(Symbol_Table * globals)
 	{
 		source.alloc();
+		this->globals = globals;
 	}
 	void dealloc()
 	{
 		source.dealloc();
 	}
+	void disassemble(Sink * sink)
+	{
+		Disassembler::disassemble(source.arr, source.size, globals, sink);
+	}
+	// Must be called once everything has been compiled --- the VM
+	// relies on every program ending in a halt
+	void finish()
+	{
+		if (Peephole::enabled) {
+			Peephole::optimize(&source);
+		}
+		source.emplace(Instr::with_type(INSTR_HALT));
+	}
 	void compile_expr(Expr * expr)
 	{
 		switch (expr->type) {
@@ -68,9 +154,12 @@ struct Compiler {
 			source.push(Instr::with_type(INSTR_TYPEOF));
 		} break;
 		case EXPR_VARIABLE: {
-			source.push(Instr::with_type_and_arg(INSTR_PUSH,
-												 Value::make_string_from_intern(expr->variable)));
-			source.push(Instr::with_type(INSTR_POP_AND_LOOKUP));
+			int slot = globals->find(expr->variable);
+			if (slot == -1) {
+				fatal("Tried to lookup nonexistent variable %s", expr->variable);
+			}
+			source.push(Instr::with_type_and_arg(INSTR_LOAD_GLOBAL,
+												 Value::make_integer(slot)));
 		} break;
 		case EXPR_INTEGER: {
 			source.push(Instr::with_type_and_arg(INSTR_PUSH,
@@ -81,6 +170,11 @@ struct Compiler {
 												 Value::make_string_from_intern(expr->string)));
 		} break;
 		case EXPR_TUPLE: {
+			if (Constants::is_constant(expr)) {
+				source.push(Instr::with_type_and_arg(INSTR_PUSH,
+													 Constants::materialize(expr)));
+				break;
+			}
 			for (int i = 0; i < expr->tuple.size; i++) {
 				compile_expr(expr->tuple[i]);
 			}
@@ -96,22 +190,37 @@ struct Compiler {
 	{
 		switch (stmt->type) {
 		case STMT_LET: {
+			const char * symbol = stmt->let.symbol;
+			if (globals->find(symbol) != -1) {
+				fatal("Tried to declare variable %s which is already bound", symbol);
+			}
+			Static_Type type;
+			bool validate = Type_Check::check_let(globals, stmt, &type);
 			compile_expr(stmt->let.right);
-			if (!stmt->let.infer) {
+			if (validate) {
 				compile_expr(stmt->let.annotation);
 				source.push(Instr::with_type(INSTR_VALIDATE_TYPE));
 			}
-			source.push(Instr::with_type_and_arg(INSTR_BIND,
-												 Value::make_string_from_intern(stmt->let.symbol)));
+			// Declared only after compiling the right-hand side, so
+			// that a variable can't refer to itself
+			int slot = globals->declare(symbol, type);
+			source.push(Instr::with_type_and_arg(INSTR_DEFINE_GLOBAL,
+												 Value::make_integer(slot)));
 		} break;
 		case STMT_ASSIGN: {
 			// Only specific expressions are valid l-expressions
 			if (stmt->assign.left->type == EXPR_VARIABLE) {
 				// Variable assignment
 				const char * symbol = stmt->assign.left->variable;
+				int slot = globals->find(symbol);
+				if (slot == -1) {
+					fatal("Tried to modify nonexistent variable %s", symbol);
+				}
+				// A store that can't fail is just a define
+				bool checked = Type_Check::check_store(globals, slot, stmt->assign.right);
 				compile_expr(stmt->assign.right);
-				source.push(Instr::with_type_and_arg(INSTR_UPDATE_BINDING,
-													 Value::make_string_from_intern(symbol)));
+				source.push(Instr::with_type_and_arg(checked ? INSTR_STORE_GLOBAL : INSTR_DEFINE_GLOBAL,
+													 Value::make_integer(slot)));
 			} else {
 				fatal("Invalid l-expression");
 			}
@@ -129,40 +238,68 @@ struct Compiler {
 			break;
 		}
 	}
+	void execute(VM * vm);
 };
 
+enum Flush_Policy {
+	FLUSH_AUTO,  // Line-buffered on a terminal, block-buffered otherwise
+	FLUSH_LINE,  // After every print
+	FLUSH_BLOCK, // Only when the buffer fills, and at exit
+};
+
+struct Reg_Instr;
+
 struct VM {
 	Instr * program;
 	size_t program_length;
 	size_t program_counter;
 	bool halted;
 
+	// Only used by the register VM
+	Reg_Instr * register_program;
+	Value * constants;
+	List<Value> registers;
+
+	Profiler * profiler; // Only set with --profile
+
 	Symbol_Table global_table;
 	List<Value> op_stack;
+	Sink output; // Everything the program prints goes through here
+	bool flush_every_line;
+	static constexpr size_t output_buffer_size = 64 * 1024;
+	// Global slots that have been handed a nursery object since the
+	// last collection. May contain duplicates.
+	List<int> remembered_slots;
 	void insert_builtin_bindings()
 	{
-		Value _int = Value::with_type(VALUE_TYPE);
-		_int.annotation = Type_Annotation::make_primitive(VALUE_INTEGER);
-		global_table.set(Intern::intern("int"), _int);
-		
-		Value _string = Value::with_type(VALUE_TYPE);
-		_string.annotation = Type_Annotation::make_primitive(VALUE_STRING);
-		global_table.set(Intern::intern("string"), _string);
-
-		Value _tuple = Value::with_type(VALUE_TYPE);
-		_tuple.annotation = Type_Annotation::make_reference(OBJ_TUPLE);
-		global_table.set(Intern::intern("tuple"), _tuple);
+		global_table.set(Intern::intern("int"),
+						 Value::make_type(Type_Annotation::primitive(VALUE_INTEGER)));
+		global_table.set(Intern::intern("string"),
+						 Value::make_type(Type_Annotation::primitive(VALUE_STRING)));
+		global_table.set(Intern::intern("tuple"),
+						 Value::make_type(Type_Annotation::reference(OBJ_TUPLE)));
 	}
-	static VM create()
+	static VM create(Flush_Policy flush_policy)
 	{
 		VM vm;
 		vm.program = NULL;
 		vm.program_length = 0;
 		vm.program_counter = 0;
 		vm.halted = true;
+		vm.profiler = NULL;
+		vm.register_program = NULL;
+		vm.constants = NULL;
+		vm.registers.alloc();
 		vm.global_table.alloc();
 		vm.insert_builtin_bindings();
 		vm.op_stack.alloc();
+		vm.op_stack.shrinks = false; // It's empty after every statement
+		vm.remembered_slots.alloc();
+		vm.output.alloc(STDOUT_FILENO, VM::output_buffer_size);
+		if (flush_policy == FLUSH_AUTO) {
+			flush_policy = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_BLOCK;
+		}
+		vm.flush_every_line = flush_policy == FLUSH_LINE;
 		return vm;
 	}
 	// NOTE: Does no deep freeing
@@ -170,104 +307,216 @@ struct VM {
 	{
 		global_table.dealloc();
 		op_stack.dealloc();
+		registers.dealloc();
+		remembered_slots.dealloc();
+		output.dealloc();
 	}
 	void prime(Instr * program, size_t program_length)
 	{
 		assert(op_stack.size == 0); // Everything should be empty between statements
+		assert(program_length > 0 && program[program_length - 1].type == INSTR_HALT);
 		this->program = program;
 		this->program_length = program_length;
 		program_counter = 0;
 		halted = false;
 	}
-	void step()
+	/** run
+	 * Executes from the current program counter until INSTR_HALT. The
+	 * program is guaranteed to end in one, so there's no bounds check
+	 * on the program counter.
+	 */
+	void run()
 	{
-		if (program_counter >= program_length) {
+		if (profiler) {
+			run_loop<true>();
+		} else {
+			run_loop<false>();
+		}
+	}
+	template <bool Profile>
+	void run_loop()
+	{
+		Instr * instr;
+#if MARCH_THREADED_DISPATCH
+		static void * dispatch_table[INSTR_COUNT] = {
+#define X(name) &&LABEL_##name,
+			INSTR_LIST(X)
+#undef X
+		};
+#define CASE(name) LABEL_##name:
+#define NEXT() instr = &program[program_counter++];					\
+			if (Profile) profiler->step(instr->type);					\
+			goto *dispatch_table[instr->type]
+		NEXT();
+#else
+#define CASE(name) case name:
+#define NEXT() continue
+		while (true) {
+		instr = &program[program_counter++];
+		if (Profile) profiler->step(instr->type);
+		switch (instr->type) {
+#endif
+		CASE(INSTR_HALT) {
+			if (Profile) profiler->finish();
 			halted = true;
 			return;
 		}
-		Instr instr = program[program_counter++];
-		switch (instr.type) {
-		case INSTR_POP_AND_DISCARD: {
+		CASE(INSTR_POP_AND_DISCARD) {
 			op_stack.pop();
-		} break;
-		case INSTR_POP_AND_OUTPUT: {
-			Value v = op_stack.pop();
-			char * s = v.to_string();
-			printf("%s\n", s);
-			free(s);
-		} break;
-		case INSTR_POP_AND_LOOKUP: {
+			NEXT();
+		}
+		CASE(INSTR_POP_AND_OUTPUT) {
 			Value v = op_stack.pop();
-			assert(v.type == VALUE_STRING);
-			// TODO(pixlark): Dangerous! We have no assertion that the
-			// string we pop is interned! How do we solve this?
-			int index = global_table.find(v.string);
-			if (index == -1) {
-				fatal("Tried to lookup nonexistent variable %s", v.string);
-			}
-			op_stack.push(global_table.values[index]);
-		} break;
-		case INSTR_PUSH: {
-			op_stack.push(instr.argument);
-		} break;
-		case INSTR_MAKE_TUPLE: {
-			assert(instr.argument.type == VALUE_INTEGER);
-			assert(instr.argument.integer >= 0);
-			
-			Obj_Tuple * tuple = (Obj_Tuple*) Collection::alloc(sizeof(Obj_Tuple));
-			tuple->length = instr.argument.integer;
-			tuple->elements = (Value*) Collection::alloc(sizeof(Value) * tuple->length);
-			for (int i = tuple->length - 1; i >= 0; i--) {
-				tuple->elements[i] = op_stack.pop();
-			}
-			
-			Value v = Value::with_type(VALUE_REFERENCE);
-			v.reference = Reference::to(tuple, OBJ_TUPLE);
-			op_stack.push(v);
-		} break;
-		case INSTR_BIND: {
-			assert(instr.argument.type == VALUE_STRING);
-			const char * symbol = instr.argument.string;
-			if (global_table.find(symbol) != -1) {
-				fatal("Tried to declare variable %s which is already bound", symbol);
-			}
-			Value to_bind = op_stack.pop();
-			global_table.set(symbol, to_bind);
-		} break;
-		case INSTR_VALIDATE_TYPE: {
+			v.print_to(&output);
+			output.put('\n');
+			if (flush_every_line) output.flush();
+			NEXT();
+		}
+		CASE(INSTR_PUSH) {
+			op_stack.push(instr->argument);
+			NEXT();
+		}
+		CASE(INSTR_MAKE_TUPLE) {
+			assert(instr->argument.type == VALUE_INTEGER);
+			assert(instr->argument.integer >= 0);
+			int length = instr->argument.integer;
+			Obj_Tuple * tuple = alloc_tuple(length);
+			pop_into(tuple->elements, length);
+			op_stack.push(Value::make_reference(tuple));
+			NEXT();
+		}
+		CASE(INSTR_LOAD_GLOBAL) {
+			op_stack.push(global_table.values[instr->argument.integer]);
+			NEXT();
+		}
+		CASE(INSTR_DEFINE_GLOBAL) {
+			define_global(instr->argument.integer, op_stack.pop());
+			NEXT();
+		}
+		CASE(INSTR_VALIDATE_TYPE) {
 			Value type = op_stack.pop();
-			assert(type.type == VALUE_TYPE);
-			if (!op_stack[op_stack.size - 1].validate_type(type.annotation)) {
-				fatal("Mismatch between expected and provided type");
-			}
-		} break;
-		case INSTR_UPDATE_BINDING: {
-			assert(instr.argument.type == VALUE_STRING);
-			const char * symbol = instr.argument.string;
-			
-			int index = global_table.find(symbol);
-			if (index == -1) {
-				fatal("Tried to modify nonexistent variable %s", symbol);
-			}
-			
-			Type_Annotation expected = global_table.values[index].get_annotation();
-			Value new_value = op_stack.pop();
-			if (!new_value.validate_type(expected)) {
-				fatal("Mismatch between expected and provided type");
-			}
-			
-			global_table.set(symbol, new_value);
-		} break;
-		case INSTR_TYPEOF: {
+			validate_top(type);
+			NEXT();
+		}
+		CASE(INSTR_STORE_GLOBAL) {
+			store_global(instr->argument.integer, op_stack.pop());
+			NEXT();
+		}
+		CASE(INSTR_TYPEOF) {
 			Value v = op_stack.pop();
-			Value type = Value::with_type(VALUE_TYPE);
-			type.annotation = v.get_annotation();
-			op_stack.push(type);
-		} break;
+			op_stack.push(Value::make_type(v.get_annotation()));
+			NEXT();
+		}
+		CASE(INSTR_PUSH_MAKE_TUPLE) {
+			int length = instr->operand;
+			Obj_Tuple * tuple = alloc_tuple(length);
+			tuple->elements[length - 1] = instr->argument;
+			pop_into(tuple->elements, length - 1);
+			op_stack.push(Value::make_reference(tuple));
+			NEXT();
+		}
+		CASE(INSTR_LOAD_GLOBAL_2) {
+			op_stack.push(global_table.values[instr->argument.integer]);
+			op_stack.push(global_table.values[instr->operand]);
+			NEXT();
+		}
+		CASE(INSTR_VALIDATE_GLOBAL_TYPE) {
+			validate_top(global_table.values[instr->argument.integer]);
+			NEXT();
+		}
+		CASE(INSTR_DEFINE_GLOBAL_CHECKED) {
+			validate_top(global_table.values[instr->argument.integer]);
+			define_global(instr->operand, op_stack.pop());
+			NEXT();
+		}
+		CASE(INSTR_DEFINE_GLOBAL_CONST) {
+			define_global(instr->operand, instr->argument);
+			NEXT();
+		}
+		CASE(INSTR_DEFINE_GLOBAL_COPY) {
+			define_global(instr->operand, global_table.values[instr->argument.integer]);
+			NEXT();
+		}
+		CASE(INSTR_MAKE_TUPLE_DEFINE_GLOBAL) {
+			int length = instr->argument.integer;
+			Obj_Tuple * tuple = alloc_tuple(length);
+			pop_into(tuple->elements, length);
+			define_global(instr->operand, Value::make_reference(tuple));
+			NEXT();
+		}
+		CASE(INSTR_MAKE_TUPLE_STORE_GLOBAL) {
+			int length = instr->argument.integer;
+			Obj_Tuple * tuple = alloc_tuple(length);
+			pop_into(tuple->elements, length);
+			store_global(instr->operand, Value::make_reference(tuple));
+			NEXT();
+		}
+		CASE(INSTR_COPY_GLOBAL) {
+			store_global(instr->operand, global_table.values[instr->argument.integer]);
+			NEXT();
+		}
+		CASE(INSTR_STORE_GLOBAL_CONST) {
+			store_global(instr->operand, instr->argument);
+			NEXT();
+		}
+		CASE(INSTR_OUTPUT_GLOBAL) {
+			global_table.values[instr->argument.integer].print_to(&output);
+			output.put('\n');
+			if (flush_every_line) output.flush();
+			NEXT();
+		}
+#if !MARCH_THREADED_DISPATCH
 		default:
-			fatal_internal("Incomplete switch in VM::step()");
+			fatal_internal("Invalid instruction %d in VM::run()", instr->type);
 			break;
 		}
+		}
+#endif
+#undef CASE
+#undef NEXT
+	}
+	Obj_Tuple * alloc_tuple(int length)
+	{
+		// Everything live is either bound or on the stack right now,
+		// so this is a safe point to collect
+		if (Collection::wants_collection()) {
+			collect_garbage();
+		}
+		return Obj_Tuple::alloc(length);
+	}
+	// Moves the top count values off the stack, keeping their order
+	void pop_into(Value * dest, int count)
+	{
+		assert(op_stack.size >= count);
+		op_stack.size -= count;
+		memcpy(dest, &op_stack.arr[op_stack.size], sizeof(Value) * count);
+	}
+	void validate_top(Value type)
+	{
+		assert(type.type == VALUE_TYPE);
+		if (!op_stack[op_stack.size - 1].validate_type(type.annotation)) {
+			fatal("Mismatch between expected and provided type");
+		}
+	}
+	void define_global(int slot, Value value)
+	{
+		write_barrier(slot, value);
+		global_table.values[slot] = value;
+	}
+	void store_global(int slot, Value value)
+	{
+		if (!value.validate_type(global_table.values[slot].get_annotation())) {
+			fatal("Mismatch between expected and provided type");
+		}
+		write_barrier(slot, value);
+		global_table.values[slot] = value;
+	}
+	void write_barrier(int slot, Value value)
+	{
+		if (value.type == VALUE_REFERENCE &&
+			Collection::is_young(value.reference.ptr)) {
+			remembered_slots.push(slot);
+		}
 	}
 	void mark_all_bound_values()
 	{
@@ -275,62 +524,396 @@ struct VM {
 			global_table.values[i].mark_for_gc();
 		}
 	}
+	void mark_remembered_values()
+	{
+		for (int i = 0; i < remembered_slots.size; i++) {
+			global_table.values[remembered_slots[i]].mark_for_gc();
+		}
+	}
+	void mark_op_stack()
+	{
+		for (int i = 0; i < op_stack.size; i++) {
+			op_stack[i].mark_for_gc();
+		}
+		for (int i = 0; i < registers.size; i++) {
+			registers[i].mark_for_gc();
+		}
+	}
+	// The same roots as the serial marking functions above
+	void mark_in_parallel(bool major)
+	{
+		Parallel_Mark::Root_Span roots[] = {
+			major ? (Parallel_Mark::Root_Span) { global_table.values.arr, NULL,
+												 global_table.values.size }
+			      : (Parallel_Mark::Root_Span) { global_table.values.arr, remembered_slots.arr,
+												 remembered_slots.size },
+			{ op_stack.arr, NULL, op_stack.size },
+			{ registers.arr, NULL, registers.size },
+		};
+		Parallel_Mark::mark(roots, sizeof(roots) / sizeof(roots[0]));
+	}
+	void collect_garbage()
+	{
+		uint64_t started = Timings::begin();
+		bool major = Collection::wants_major_collection();
+		GC_Stats::Cycle cycle;
+		GC_Stats::begin_cycle(&cycle, major);
+		uint64_t pause_start = GC_Stats::clock_ns();
+		if (major) {
+			Collection::begin_major_collection();
+		} else {
+			Collection::begin_minor_collection();
+		}
+		if (Parallel_Mark::worker_count > 1) {
+			mark_in_parallel(major);
+		} else if (major) {
+			mark_all_bound_values();
+			mark_op_stack();
+			mark_gray_objects();
+		} else {
+			// Only young objects are traced, starting from the stack
+			// and from whatever globals were written since last time
+			mark_remembered_values();
+			mark_op_stack();
+			mark_gray_objects();
+		}
+		uint64_t sweep_start = GC_Stats::clock_ns();
+		if (major) {
+			Collection::sweep_tenured();
+			Collection::sweep_nursery();
+			Collection::end_major_collection();
+		} else {
+			Collection::sweep_nursery();
+		}
+		// The nursery is empty now, so no global points into it
+		remembered_slots.clear();
+		uint64_t pause_end = GC_Stats::clock_ns();
+		cycle.mark_ns = sweep_start - pause_start;
+		cycle.sweep_ns = pause_end - sweep_start;
+		cycle.pause_ns = pause_end - pause_start;
+		// Freeing what was found dead happens after the pause
+		Sweeper::hand_off(&Collection::doomed);
+		GC_Stats::end_cycle(&cycle);
+		Timings::end(&Timings::gc, started);
+		Timings::collections++;
+	}
+	void prime_registers(Reg_Instr * program, Value * constants, int register_count);
+	void run_registers();
+	template <bool Profile>
+	void run_registers_loop();
+};
+
+void Compiler::execute(VM * vm)
+{
+	vm->prime(source.arr, source.size);
+	vm->run();
+	// Make sure we haven't reached an invalid state
+	assert(vm->op_stack.size == 0);
+}
+
+#include "register-vm.cc" // Needs VM
+#include "bytecode-cache.cc" // Needs Instr and Symbol_Table
+
+enum Backend {
+	BACKEND_STACK,
+	BACKEND_REGISTER,
 };
 
+struct Options {
+	const char * path;
+	bool whole_program;
+	bool huge_pages;
+	Flush_Policy flush_policy;
+	Backend backend;
+	bool disassemble;
+	bool profile;
+	bool timings;
+	bool gc_stats;
+	const char * gc_trace_path;
+	int gc_threads;
+	static constexpr int max_gc_threads = 256;
+	bool peephole;
+	bool type_check;
+	bool cache;
+	static bool parse(int argc, char ** argv, Options * options)
+	{
+		options->path = NULL;
+		options->whole_program = false;
+		options->huge_pages = false;
+		options->flush_policy = FLUSH_AUTO;
+		options->backend = BACKEND_STACK;
+		options->disassemble = false;
+		options->profile = false;
+		options->timings = false;
+		options->gc_stats = false;
+		options->gc_trace_path = NULL;
+		options->gc_threads = 1;
+		options->peephole = true;
+		options->type_check = true;
+		options->cache = false;
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], "--whole-program") == 0) {
+				options->whole_program = true;
+			} else if (strcmp(argv[i], "--huge-pages") == 0) {
+				options->huge_pages = true;
+			} else if (strcmp(argv[i], "--flush=auto") == 0) {
+				options->flush_policy = FLUSH_AUTO;
+			} else if (strcmp(argv[i], "--flush=line") == 0) {
+				options->flush_policy = FLUSH_LINE;
+			} else if (strcmp(argv[i], "--flush=block") == 0) {
+				options->flush_policy = FLUSH_BLOCK;
+			} else if (strcmp(argv[i], "--vm=stack") == 0) {
+				options->backend = BACKEND_STACK;
+			} else if (strcmp(argv[i], "--vm=register") == 0) {
+				options->backend = BACKEND_REGISTER;
+			} else if (strcmp(argv[i], "--disasm") == 0) {
+				options->disassemble = true;
+			} else if (strcmp(argv[i], "--profile") == 0) {
+				options->profile = true;
+			} else if (strcmp(argv[i], "--gc-stats") == 0) {
+				options->gc_stats = true;
+			} else if (strncmp(argv[i], "--gc-trace=", 11) == 0 && argv[i][11] != '\0') {
+				options->gc_trace_path = argv[i] + 11;
+			} else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+				char * end;
+				long threads = strtol(argv[i] + 13, &end, 10);
+				if (end == argv[i] + 13 || *end != '\0' ||
+					threads < 1 || threads > Options::max_gc_threads) {
+					printf("--gc-threads takes a number from 1 to %d\n", Options::max_gc_threads);
+					return false;
+				}
+				options->gc_threads = threads;
+			} else if (strcmp(argv[i], "--timings") == 0) {
+				options->timings = true;
+			} else if (strcmp(argv[i], "--cache") == 0) {
+				options->cache = true;
+			} else if (strcmp(argv[i], "--no-peephole") == 0) {
+				options->peephole = false;
+			} else if (strcmp(argv[i], "--no-type-check") == 0) {
+				options->type_check = false;
+			} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+				printf("Unknown option %s\n", argv[i]);
+				return false;
+			} else if (options->path) {
+				printf("Provide one source file.\n");
+				return false;
+			} else {
+				options->path = argv[i];
+			}
+		}
+		if (!options->path) {
+			printf("Provide one source file.\n");
+			return false;
+		}
+		if (options->cache && options->backend != BACKEND_STACK) {
+			printf("--cache only works with --vm=stack.\n");
+			return false;
+		}
+		// There's nowhere to put a cache for standard input
+		if (strcmp(options->path, "-") == 0) {
+			options->cache = false;
+		}
+		return true;
+	}
+};
+
+// Compiles and runs each top-level statement as soon as it's
+// parsed. Each statement's bytecode goes to disasm, if it's set.
+template <typename Compiler_Type>
+void run_per_statement(Parser * parser, VM * vm, Sink * disasm)
+{
+	while (!parser->at_end()) {
+		// Get AST
+		uint64_t started = Timings::begin();
+		Stmt * stmt = parser->parse_stmt();
+		Timings::end(&Timings::parse, started);
+
+		// Compile AST to bytecode
+		started = Timings::begin();
+		Compiler_Type compiler;
+		compiler.alloc(&vm->global_table);
+		compiler.compile_stmt(stmt);
+		compiler.finish();
+		Timings::end(&Timings::compile, started);
+		if (disasm) compiler.disassemble(disasm);
+
+		// Run bytecode
+		started = Timings::begin();
+		compiler.execute(vm);
+		Timings::end(&Timings::execute, started);
+		
+		// Free some stuff
+		compiler.dealloc();
+		parser->arena->reset();
+	}
+}
+
+template <typename Compiler_Type>
+void compile_whole_program(Parser * parser, Compiler_Type * compiler)
+{
+	while (!parser->at_end()) {
+		uint64_t started = Timings::begin();
+		Stmt * stmt = parser->parse_stmt();
+		Timings::end(&Timings::parse, started);
+		started = Timings::begin();
+		compiler->compile_stmt(stmt);
+		Timings::end(&Timings::compile, started);
+		parser->arena->reset();
+	}
+	uint64_t started = Timings::begin();
+	compiler->finish();
+	Timings::end(&Timings::compile, started);
+}
+
+// Compiles the entire file into one chunk of bytecode before running
+// any of it
+template <typename Compiler_Type>
+void run_whole_program(Parser * parser, VM * vm, Sink * disasm)
+{
+	Compiler_Type compiler;
+	compiler.alloc(&vm->global_table);
+	compile_whole_program(parser, &compiler);
+	if (disasm) compiler.disassemble(disasm);
+	uint64_t started = Timings::begin();
+	compiler.execute(vm);
+	Timings::end(&Timings::execute, started);
+	compiler.dealloc();
+}
+
+/** run_cached
+ * Runs the program straight from its bytecode cache if that's up to
+ * date. Otherwise compiles the whole program, as run_whole_program()
+ * does, and writes a fresh cache before running it.
+ */
+void run_cached(const char * source_path, Source_Text * source, Parser * parser,
+				VM * vm, Sink * disasm)
+{
+	char * cache_path = Bytecode_Cache::path_for(source_path);
+	Bytecode_Cache::Program program;
+	uint64_t started = Timings::begin();
+	bool loaded = Bytecode_Cache::load(cache_path, source, &vm->global_table, &program);
+	Timings::end(&Timings::cache, started);
+	if (loaded) {
+		if (disasm) {
+			Disassembler::disassemble(program.instrs, program.instr_count,
+									  &vm->global_table, disasm);
+		}
+		started = Timings::begin();
+		vm->prime(program.instrs, program.instr_count);
+		vm->run();
+		assert(vm->op_stack.size == 0);
+		Timings::end(&Timings::execute, started);
+		program.unload();
+	} else {
+		Compiler compiler;
+		compiler.alloc(&vm->global_table);
+		compile_whole_program(parser, &compiler);
+		if (disasm) compiler.disassemble(disasm);
+		started = Timings::begin();
+		Bytecode_Cache::save(cache_path, source, compiler.source.arr,
+							 compiler.source.size, &vm->global_table);
+		Timings::end(&Timings::cache, started);
+		started = Timings::begin();
+		compiler.execute(vm);
+		Timings::end(&Timings::execute, started);
+		compiler.dealloc();
+	}
+	free(cache_path);
+}
+
+// Output is buffered, so flush it before an error aborts us
+static Sink * pending_output = NULL;
+void flush_pending_output()
+{
+	if (pending_output) pending_output->flush();
+}
+
 int main(int argc, char ** argv)
 {
-	if (argc != 2) {
-		printf("Provide one source file.\n");
+	Options options;
+	if (!Options::parse(argc, argv, &options)) {
 		return 1;
 	}
 
-	const char * source = load_string_from_file(argv[1]);
-	if (!source) {
+	Source_Text source;
+	if (!Source_Text::load(options.path, &source)) {
 		printf("File does not exist.\n");
 		return 1;
 	}
 	
+	if (options.timings) Timings::init();
 	Intern::init();
+	Pool::use_huge_pages = options.huge_pages;
+	Peephole::enabled = options.peephole;
+	Type_Check::enabled = options.type_check;
 	Collection::init();
-	Lexer lexer(source);
-	Parser parser(&lexer);
-	VM vm = VM::create();
-	
-	while (!parser.at_end()) {
-		// Get AST
-		Stmt * stmt = parser.parse_stmt();
-
-		// Compile AST to bytecode
-		Compiler compiler;
-		compiler.alloc();
-		compiler.compile_stmt(stmt);
+	Sweeper::init();
+	if (!GC_Stats::init(options.gc_stats, options.gc_trace_path)) {
+		printf("Couldn't open %s for the GC trace.\n", options.gc_trace_path);
+		return 1;
+	}
+	if (options.gc_threads > 1) {
+		Parallel_Mark::init(options.gc_threads);
+	}
+	Lexer lexer(source.data, source.length);
+	Arena ast_arena;
+	ast_arena.alloc();
+	Parser parser(&lexer, &ast_arena);
+	VM vm = VM::create(options.flush_policy);
+	pending_output = &vm.output;
+	before_fatal = flush_pending_output;
 
-		// Run bytecode
-		vm.prime(compiler.source.arr, compiler.source.size);
-		while (!vm.halted) {
-			vm.step();
+	// Diagnostics go to stderr, so they never mix with program output
+	Sink diagnostics;
+	diagnostics.alloc(STDERR_FILENO);
+	Sink * disasm = options.disassemble ? &diagnostics : NULL;
+	Profiler profiler;
+	if (options.profile) {
+		if (options.backend == BACKEND_REGISTER) {
+			profiler.alloc(reg_instr_names, REG_INSTR_COUNT);
+		} else {
+			profiler.alloc(instr_names, INSTR_COUNT);
 		}
+		vm.profiler = &profiler;
+	}
 
-		// Make sure we haven't reached an invalid state
-		assert(vm.op_stack.size == 0);
-		
-		// Free some stuff
-		compiler.dealloc();
-		stmt->deep_free();
-		free(stmt);
-
-		// Run garbage collector
-		Collection::unmark_all();
-		vm.mark_all_bound_values();
-		size_t allocations_before = Collection::ptrs.size;
-		Collection::collect_unmarked();
-		printf("Collected %d references; from %d to %d\n",
-			   allocations_before - Collection::ptrs.size,
-			   allocations_before,  Collection::ptrs.size);
+	if (options.backend == BACKEND_REGISTER) {
+		if (options.whole_program) {
+			run_whole_program<Register_Compiler>(&parser, &vm, disasm);
+		} else {
+			run_per_statement<Register_Compiler>(&parser, &vm, disasm);
+		}
+	} else if (options.cache) {
+		run_cached(options.path, &source, &parser, &vm, disasm);
+	} else {
+		if (options.whole_program) {
+			run_whole_program<Compiler>(&parser, &vm, disasm);
+		} else {
+			run_per_statement<Compiler>(&parser, &vm, disasm);
+		}
 	}
 
+	if (options.profile) {
+		vm.output.flush();
+		diagnostics.flush();
+		profiler.report(&diagnostics);
+		profiler.dealloc();
+	}
+	if (options.timings) {
+		vm.output.flush();
+		Timings::report(&diagnostics, options.path);
+	}
+	vm.output.flush();
+	GC_Stats::finish(&diagnostics);
+	diagnostics.dealloc();
 	vm.destroy();
+	pending_output = NULL;
+	ast_arena.dealloc();
+	if (Parallel_Mark::worker_count > 1) {
+		Parallel_Mark::shutdown();
+	}
+	Sweeper::shutdown();
 	Collection::destroy_everything();
 	Intern::destroy_everything();
-	free((void*) source);
+	source.unload();
 }
@@ -0,0 +1,329 @@
+/** Parallel_Mark
+ * Marks with a pool of threads, for --gc-threads=N. The collecting
+ * thread takes part as worker 0, and N - 1 more threads sleep between
+ * collections.
+ *
+ * Each worker marks its share of the roots, then traces from its own
+ * deque of gray objects. A worker that runs dry steals from the others,
+ * and marking is over once every worker is idle at the same time.
+ * Mark bits are set with an atomic or, so an object is only ever
+ * traced by the one worker that marked it.
+ *
+ * Objects are immutable and nothing allocates during marking, so the
+ * only shared state is the mark bits and the deques.
+ */
+namespace Parallel_Mark {
+	/** Deque
+	 * A Chase-Lev work-stealing deque. The owner pushes and takes at
+	 * the bottom, and thieves steal from the top. Arrays that are
+	 * outgrown are kept until the collection ends, since a thief may
+	 * still be reading one.
+	 */
+	struct Deque {
+		struct Array {
+			int64_t capacity; // Always a power of two
+			void ** items;
+		};
+		int64_t top;
+		int64_t bottom;
+		Array * array;
+		List<Array*> retired;
+		static constexpr int64_t initial_capacity = 1024;
+		static Array * new_array(int64_t capacity)
+		{
+			Array * array = (Array*) malloc(sizeof(Array));
+			array->capacity = capacity;
+			array->items = (void**) malloc(sizeof(void*) * capacity);
+			return array;
+		}
+		static void free_array(Array * array)
+		{
+			free(array->items);
+			free(array);
+		}
+		void alloc()
+		{
+			top = 0;
+			bottom = 0;
+			array = new_array(Deque::initial_capacity);
+			retired.alloc();
+		}
+		void dealloc()
+		{
+			reset();
+			free_array(array);
+			retired.dealloc();
+		}
+		// Only once marking is over and the deque is empty
+		void reset()
+		{
+			top = 0;
+			bottom = 0;
+			for (int i = 0; i < retired.size; i++) {
+				free_array(retired[i]);
+			}
+			retired.clear();
+		}
+		Array * grow(Array * old, int64_t t, int64_t b)
+		{
+			Array * bigger = new_array(old->capacity * 2);
+			for (int64_t i = t; i < b; i++) {
+				bigger->items[i & (bigger->capacity - 1)] = old->items[i & (old->capacity - 1)];
+			}
+			retired.push(old);
+			__atomic_store_n(&array, bigger, __ATOMIC_RELEASE);
+			return bigger;
+		}
+		void push(void * item)
+		{
+			int64_t b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+			int64_t t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+			Array * a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+			if (b - t > a->capacity - 1) {
+				a = grow(a, t, b);
+			}
+			__atomic_store_n(&a->items[b & (a->capacity - 1)], item, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+		}
+		// Owner only. Returns NULL if empty.
+		void * take()
+		{
+			int64_t b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+			Array * a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+			__atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			int64_t t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+			if (t > b) {
+				__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			void * item = __atomic_load_n(&a->items[b & (a->capacity - 1)], __ATOMIC_RELAXED);
+			if (t == b) {
+				// Last item, so race any thieves for it
+				if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+												 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+					item = NULL;
+				}
+				__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+			}
+			return item;
+		}
+		// Any thread. Returns NULL if empty or if another thread won.
+		void * steal()
+		{
+			int64_t t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			int64_t b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+			if (t >= b) return NULL;
+			Array * a = __atomic_load_n(&array, __ATOMIC_ACQUIRE);
+			void * item = __atomic_load_n(&a->items[t & (a->capacity - 1)], __ATOMIC_RELAXED);
+			if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+											 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				return NULL;
+			}
+			return item;
+		}
+		bool looks_empty()
+		{
+			return __atomic_load_n(&top, __ATOMIC_ACQUIRE) >=
+				__atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+		}
+	};
+
+	/** Root_Span
+	 * A run of root values: values[0..count), or values[slots[i]] for
+	 * each i if slots is set.
+	 */
+	struct Root_Span {
+		Value * values;
+		int * slots;
+		size_t count;
+	};
+
+	struct Worker {
+		pthread_t thread;
+		int index;
+		uint32_t random_state;
+		Deque deque;
+	};
+
+	Worker * workers;
+	int worker_count = 1;
+	Root_Span * spans;
+	int span_count;
+	int idle_workers;
+	// Workers sleep on start until generation changes
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+	pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+	uint64_t generation;
+	int finished_workers;
+	bool shutting_down;
+
+	void shade(Worker * worker, Value value)
+	{
+		if (value.type == VALUE_REFERENCE &&
+			Collection::mark_ptr_atomic(value.reference.ptr)) {
+			worker->deque.push(value.reference.ptr);
+		}
+	}
+	void trace(Worker * worker, void * ptr)
+	{
+		switch (Collection::header_of(ptr)->kind) {
+		case OBJ_TUPLE: {
+			Obj_Tuple * tuple = (Obj_Tuple*) ptr;
+			for (size_t i = 0; i < tuple->length; i++) {
+				shade(worker, tuple->elements[i]);
+			}
+		} break;
+		default:
+			fatal_internal("Incomplete switch in Parallel_Mark::trace()");
+		}
+	}
+	void shade_roots(Worker * worker)
+	{
+		for (int s = 0; s < span_count; s++) {
+			Root_Span span = spans[s];
+			size_t begin = span.count * worker->index / worker_count;
+			size_t end = span.count * (worker->index + 1) / worker_count;
+			for (size_t i = begin; i < end; i++) {
+				shade(worker, span.slots ? span.values[span.slots[i]] : span.values[i]);
+			}
+		}
+	}
+	void * steal_from_others(Worker * worker)
+	{
+		for (int attempt = 0; attempt < 2 * worker_count; attempt++) {
+			// xorshift
+			uint32_t x = worker->random_state;
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			worker->random_state = x;
+			int victim = x % worker_count;
+			if (victim == worker->index) continue;
+			void * item = workers[victim].deque.steal();
+			if (item) return item;
+		}
+		return NULL;
+	}
+	bool any_work_left()
+	{
+		for (int i = 0; i < worker_count; i++) {
+			if (!workers[i].deque.looks_empty()) return true;
+		}
+		return false;
+	}
+	void run_worker(Worker * worker)
+	{
+		shade_roots(worker);
+		while (true) {
+			void * item;
+			while ((item = worker->deque.take())) {
+				trace(worker, item);
+			}
+			if ((item = steal_from_others(worker))) {
+				trace(worker, item);
+				continue;
+			}
+			// An idle worker's deque is empty, and only its owner
+			// pushes to a deque, so once everyone is idle there's no
+			// work anywhere and none can appear
+			__atomic_fetch_add(&idle_workers, 1, __ATOMIC_SEQ_CST);
+			while (true) {
+				if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) == worker_count) {
+					return;
+				}
+				if (any_work_left()) {
+					__atomic_fetch_sub(&idle_workers, 1, __ATOMIC_SEQ_CST);
+					break;
+				}
+				sched_yield();
+			}
+		}
+	}
+	void * worker_main(void * arg)
+	{
+		Worker * worker = (Worker*) arg;
+		uint64_t seen = 0;
+		while (true) {
+			pthread_mutex_lock(&lock);
+			while (generation == seen && !shutting_down) {
+				pthread_cond_wait(&start, &lock);
+			}
+			if (shutting_down) {
+				pthread_mutex_unlock(&lock);
+				return NULL;
+			}
+			seen = generation;
+			pthread_mutex_unlock(&lock);
+
+			run_worker(worker);
+
+			pthread_mutex_lock(&lock);
+			if (++finished_workers == worker_count - 1) {
+				pthread_cond_signal(&done);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	void init(int threads)
+	{
+		worker_count = threads;
+		generation = 0;
+		shutting_down = false;
+		workers = (Worker*) malloc(sizeof(Worker) * worker_count);
+		for (int i = 0; i < worker_count; i++) {
+			workers[i].index = i;
+			workers[i].random_state = 2463534242u + i * 7919;
+			workers[i].deque.alloc();
+		}
+		for (int i = 1; i < worker_count; i++) {
+			if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+				fatal("Couldn't start GC thread %d", i);
+			}
+		}
+	}
+	void shutdown()
+	{
+		pthread_mutex_lock(&lock);
+		shutting_down = true;
+		pthread_cond_broadcast(&start);
+		pthread_mutex_unlock(&lock);
+		for (int i = 1; i < worker_count; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		for (int i = 0; i < worker_count; i++) {
+			workers[i].deque.dealloc();
+		}
+		free(workers);
+		worker_count = 1;
+	}
+	/** mark
+	 * Marks everything reachable from the given roots, on every
+	 * worker, and returns once they're all done.
+	 */
+	void mark(Root_Span * roots, int root_count)
+	{
+		pthread_mutex_lock(&lock);
+		spans = roots;
+		span_count = root_count;
+		idle_workers = 0;
+		finished_workers = 0;
+		generation++;
+		pthread_cond_broadcast(&start);
+		pthread_mutex_unlock(&lock);
+
+		run_worker(&workers[0]);
+
+		pthread_mutex_lock(&lock);
+		while (finished_workers < worker_count - 1) {
+			pthread_cond_wait(&done, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+		for (int i = 0; i < worker_count; i++) {
+			workers[i].deque.reset();
+		}
+	}
+}
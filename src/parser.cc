@@ -1,3 +1,16 @@
+struct Expr;
+
+// A fixed-size array of child expressions, allocated in the AST arena
+struct Expr_Array {
+	Expr ** arr;
+	size_t size;
+	Expr *& operator[](size_t index)
+	{
+		assert(index < size);
+		return arr[index];
+	}
+};
+
 enum Expr_Type {
 	EXPR_TYPEOF,
 	EXPR_VARIABLE,
@@ -13,7 +26,7 @@ struct Expr {
 		int integer;
 		const char * variable;
 		const char * string;
-		List<Expr*> tuple;
+		Expr_Array tuple;
 		struct {
 			List<const char *> symbols;
 			List<Expr*> annotations;
@@ -22,9 +35,9 @@ struct Expr {
 			Expr * expr;
 		} type_of;
 	};
-	static Expr * with_type(Expr_Type type)
+	static Expr * with_type(Arena * arena, Expr_Type type)
 	{
-		Expr * expr = (Expr*) malloc(sizeof(Expr));
+		Expr * expr = (Expr*) arena->push(sizeof(Expr));
 		expr->type = type;
 		return expr;
 	}
@@ -52,7 +65,6 @@ struct Expr {
 		}
 		return builder.final_string();
 	}
-	void deep_free();
 };
 
 enum Stmt_Type {
@@ -80,19 +92,25 @@ struct Stmt {
 		} print;
 		Expr * expr;
 	};
-	static Stmt * with_type(Stmt_Type type)
+	static Stmt * with_type(Arena * arena, Stmt_Type type)
 	{
-		Stmt * stmt = (Stmt*) malloc(sizeof(Stmt));
+		Stmt * stmt = (Stmt*) arena->push(sizeof(Stmt));
 		stmt->type = type;
 		return stmt;
 	}
-	void deep_free();
 };
 
+/** Parser
+ * Every node is allocated out of arena, and stays valid until the
+ * arena is reset --- the parser never frees anything itself.
+ */
 struct Parser {
 	Lexer * lexer;
 	Token peek;
-	Parser(Lexer * lexer);
+	Arena * arena;
+	List<Expr*, 16> scratch; // Children of the tuples currently being parsed
+	Parser(Lexer * lexer, Arena * arena);
+	~Parser();
 	bool is(Token_Type type);
 	bool at_end();
 	Token next();
@@ -102,18 +120,26 @@ struct Parser {
 	bool match(Token_Type type);
 	Expr * parse_atom();
 	Expr * parse_tuple();
+	Expr * finish_tuple(size_t scratch_base);
 	Expr * parse_structured();
 	Expr * parse_type();
 	Expr * parse_expr();
 	Stmt * parse_stmt();
 };
 
-Parser::Parser(Lexer * lexer)
+Parser::Parser(Lexer * lexer, Arena * arena)
 {
 	this->lexer = lexer;
+	this->arena = arena;
+	scratch.alloc();
 	this->peek = lexer->next_token();
 }
 
+Parser::~Parser()
+{
+	scratch.dealloc();
+}
+
 bool Parser::is(Token_Type type)
 {
 	return peek.type == type;
@@ -153,7 +179,9 @@ Token Parser::weak_expect(Token_Type type)
 
 void Parser::advance()
 {
+	uint64_t started = Timings::begin();
 	this->peek = lexer->next_token();
+	Timings::end(&Timings::lex, started);
 }
 
 bool Parser::match(Token_Type type)
@@ -169,18 +197,19 @@ bool Parser::match(Token_Type type)
 Expr * Parser::parse_atom()
 {
 	if (is(TOKEN_SYMBOL)) {
-		Expr * expr = Expr::with_type(EXPR_VARIABLE);
+		Expr * expr = Expr::with_type(arena, EXPR_VARIABLE);
 		expr->variable = next().values.symbol;
 		return expr;
 	} else if (is(TOKEN_INTEGER_LITERAL)) {
-		Expr * expr = Expr::with_type(EXPR_INTEGER);
+		Expr * expr = Expr::with_type(arena, EXPR_INTEGER);
 		Token tok = next();
 		expr->integer = tok.values.integer;
 		return expr;
 	} else if (is(TOKEN_STRING_LITERAL)) {
-		Expr * expr = Expr::with_type(EXPR_STRING);
+		Expr * expr = Expr::with_type(arena, EXPR_STRING);
 		Token tok = next();
 		expr->string = tok.values.string;
+		return expr;
 	} else {
 		fatal("Unexpected %s in expression", peek.to_string());
 	}
@@ -189,28 +218,25 @@ Expr * Parser::parse_atom()
 Expr * Parser::parse_tuple()
 {
 	if (match((Token_Type) '(')) {
+		size_t scratch_base = scratch.size;
 		// Hack for empty tuple
 		if (match((Token_Type) ')')) {
-			Expr * expr = Expr::with_type(EXPR_TUPLE);
-			expr->tuple.alloc();
-			return expr;
+			return finish_tuple(scratch_base);
 		}
 		// Lookahead and backtrack
 		Expr * left = parse_expr();
 		if (match((Token_Type) ',')) {
 			// Tuple
-			Expr * expr = Expr::with_type(EXPR_TUPLE);
-			expr->tuple.alloc();
-			expr->tuple.push(left);
+			scratch.push(left);
 			while (true) {
 				if (match((Token_Type) ')')) break;
-				expr->tuple.push(parse_expr());
+				scratch.push(parse_expr());
 				if (!match((Token_Type) ',')) {
 					expect((Token_Type) ')');
 					break;
 				}
 			}
-			return expr;
+			return finish_tuple(scratch_base);
 		} else {
 			// Just a parenthesized expr
 			expect((Token_Type) ')');
@@ -221,10 +247,22 @@ Expr * Parser::parse_tuple()
 	}
 }
 
+// Moves the children pushed to scratch since scratch_base into the
+// arena, as a new tuple expression
+Expr * Parser::finish_tuple(size_t scratch_base)
+{
+	Expr * expr = Expr::with_type(arena, EXPR_TUPLE);
+	expr->tuple.size = scratch.size - scratch_base;
+	expr->tuple.arr = (Expr**) arena->push(sizeof(Expr*) * expr->tuple.size);
+	memcpy(expr->tuple.arr, scratch.arr + scratch_base, sizeof(Expr*) * expr->tuple.size);
+	scratch.size = scratch_base;
+	return expr;
+}
+
 Expr * Parser::parse_structured()
 {
 	if (match(TOKEN_TYPEOF)) {
-		Expr * expr = Expr::with_type(EXPR_TYPEOF);
+		Expr * expr = Expr::with_type(arena, EXPR_TYPEOF);
 		expr->type_of.expr = parse_expr();
 		return expr;
 	}
@@ -259,7 +297,7 @@ Expr * Parser::parse_expr()
 Stmt * Parser::parse_stmt()
 {
 	if (match(TOKEN_LET)) {
-		Stmt * stmt = Stmt::with_type(STMT_LET);
+		Stmt * stmt = Stmt::with_type(arena, STMT_LET);
 		weak_expect(TOKEN_SYMBOL);
 		stmt->let.symbol = next().values.symbol;
 		expect((Token_Type) ':');
@@ -273,20 +311,20 @@ Stmt * Parser::parse_stmt()
 		expect((Token_Type) ';');
 		return stmt;
 	} else if (match(TOKEN_PRINT)) {
-		Stmt * stmt = Stmt::with_type(STMT_PRINT);
+		Stmt * stmt = Stmt::with_type(arena, STMT_PRINT);
 		stmt->print.expr = parse_expr();
 		expect((Token_Type) ';');
 		return stmt;
 	} else {
 		Expr * left = parse_expr();
 		if (match((Token_Type) '=')) {
-			Stmt * stmt = Stmt::with_type(STMT_ASSIGN);
+			Stmt * stmt = Stmt::with_type(arena, STMT_ASSIGN);
 			stmt->assign.left = left;
 			stmt->assign.right = parse_expr();
 			expect((Token_Type) ';');
 			return stmt;
 		} else {
-			Stmt * stmt = Stmt::with_type(STMT_EXPR);
+			Stmt * stmt = Stmt::with_type(arena, STMT_EXPR);
 			stmt->expr = left;
 			expect((Token_Type) ';');
 			return stmt;
@@ -0,0 +1,151 @@
+/** Peephole
+ * Rewrites compiled stack bytecode before it runs. Programs are
+ * straight-line, so the instruction just before another one is always
+ * the one that produced the value on top of the stack, and patterns
+ * can be matched by looking back at what has already been emitted.
+ *
+ * There are two passes. The first drops values that are computed just
+ * to be discarded. The second fuses common pairs into
+ * superinstructions, which were picked by counting adjacent opcode
+ * pairs over a corpus of scripts.
+ */
+namespace Peephole {
+	bool enabled = true;
+
+	// Whether an instruction only pushes one value computed from what
+	// it pops, with no other effect
+	bool is_pure(Instr * instr)
+	{
+		switch (instr->type) {
+		case INSTR_PUSH:
+		case INSTR_LOAD_GLOBAL:
+		case INSTR_MAKE_TUPLE:
+		case INSTR_TYPEOF:
+			return true;
+		default:
+			return false;
+		}
+	}
+	int pop_count(Instr * instr)
+	{
+		switch (instr->type) {
+		case INSTR_MAKE_TUPLE:
+			return instr->argument.integer;
+		case INSTR_TYPEOF:
+			return 1;
+		default:
+			return 0;
+		}
+	}
+	/** eliminate_discards
+	 * A discard right after a pure instruction cancels it, but leaves
+	 * whatever that instruction popped to be discarded in turn. Since
+	 * every expression is pure, expression statements disappear.
+	 */
+	void eliminate_discards(List<Instr> * source, List<Instr> * out)
+	{
+		for (int i = 0; i < source->size; i++) {
+			Instr instr = (*source)[i];
+			if (instr.type != INSTR_POP_AND_DISCARD) {
+				out->push(instr);
+				continue;
+			}
+			int pending = 1;
+			while (pending > 0 && out->size > 0 && is_pure(&(*out)[out->size - 1])) {
+				Instr producer = out->pop();
+				pending += pop_count(&producer) - 1;
+			}
+			for (int j = 0; j < pending; j++) {
+				out->push(Instr::with_type(INSTR_POP_AND_DISCARD));
+			}
+		}
+	}
+	// Replaces the last emitted instruction with a fused one
+	void fuse(List<Instr> * out, Instr_Type type, Value argument, int operand)
+	{
+		(*out)[out->size - 1] = Instr::with_operands(type, argument, operand);
+	}
+	void fuse_pairs(List<Instr> * source, List<Instr> * out)
+	{
+		for (int i = 0; i < source->size; i++) {
+			Instr instr = (*source)[i];
+			if (out->size == 0) {
+				out->push(instr);
+				continue;
+			}
+			Instr last = (*out)[out->size - 1];
+			switch (instr.type) {
+			case INSTR_MAKE_TUPLE:
+				if (last.type == INSTR_PUSH) {
+					fuse(out, INSTR_PUSH_MAKE_TUPLE, last.argument, instr.argument.integer);
+					continue;
+				}
+				break;
+			case INSTR_LOAD_GLOBAL:
+				if (last.type == INSTR_LOAD_GLOBAL) {
+					fuse(out, INSTR_LOAD_GLOBAL_2, last.argument, instr.argument.integer);
+					continue;
+				}
+				break;
+			case INSTR_VALIDATE_TYPE:
+				if (last.type == INSTR_LOAD_GLOBAL) {
+					fuse(out, INSTR_VALIDATE_GLOBAL_TYPE, last.argument, 0);
+					continue;
+				}
+				break;
+			case INSTR_DEFINE_GLOBAL:
+				if (last.type == INSTR_VALIDATE_GLOBAL_TYPE) {
+					fuse(out, INSTR_DEFINE_GLOBAL_CHECKED, last.argument, instr.argument.integer);
+					continue;
+				}
+				if (last.type == INSTR_PUSH) {
+					fuse(out, INSTR_DEFINE_GLOBAL_CONST, last.argument, instr.argument.integer);
+					continue;
+				}
+				// Stores that Type_Check proved are defines too
+				if (last.type == INSTR_LOAD_GLOBAL) {
+					fuse(out, INSTR_DEFINE_GLOBAL_COPY, last.argument, instr.argument.integer);
+					continue;
+				}
+				if (last.type == INSTR_MAKE_TUPLE) {
+					fuse(out, INSTR_MAKE_TUPLE_DEFINE_GLOBAL, last.argument, instr.argument.integer);
+					continue;
+				}
+				break;
+			case INSTR_STORE_GLOBAL:
+				if (last.type == INSTR_MAKE_TUPLE) {
+					fuse(out, INSTR_MAKE_TUPLE_STORE_GLOBAL, last.argument, instr.argument.integer);
+					continue;
+				}
+				if (last.type == INSTR_LOAD_GLOBAL) {
+					fuse(out, INSTR_COPY_GLOBAL, last.argument, instr.argument.integer);
+					continue;
+				}
+				if (last.type == INSTR_PUSH) {
+					fuse(out, INSTR_STORE_GLOBAL_CONST, last.argument, instr.argument.integer);
+					continue;
+				}
+				break;
+			case INSTR_POP_AND_OUTPUT:
+				if (last.type == INSTR_LOAD_GLOBAL) {
+					fuse(out, INSTR_OUTPUT_GLOBAL, last.argument, 0);
+					continue;
+				}
+				break;
+			default:
+				break;
+			}
+			out->push(instr);
+		}
+	}
+	void optimize(List<Instr> * source)
+	{
+		List<Instr> live;
+		live.alloc();
+		live.reserve(source->size);
+		eliminate_discards(source, &live);
+		source->clear();
+		fuse_pairs(&live, source);
+		live.dealloc();
+	}
+}
@@ -0,0 +1,148 @@
+/** Pool
+ * Size-class allocator for the managed heap. Small cells are carved
+ * out of large chunks: allocation pops the class's free list if it has
+ * anything, and bumps a pointer through the current chunk
+ * otherwise. Anything bigger than the largest class goes straight to
+ * malloc.
+ *
+ * Cell sizes are all multiples of 16 and chunks are aligned to their
+ * size, so every cell is 16-byte aligned.
+ *
+ * Everything here belongs to the interpreter thread except each
+ * class's returned list, which the sweeper thread pushes freed cells
+ * onto. The free list takes the whole returned list at once when it
+ * runs out.
+ */
+namespace Pool {
+	struct Free_Cell {
+		Free_Cell * next;
+	};
+	struct Size_Class {
+		size_t cell_size;
+		uint8_t * bump;
+		uint8_t * bump_limit;
+		Free_Cell * free_list;
+		Free_Cell * returned; // Shared with the sweeper thread
+	};
+	static const size_t cell_sizes[] = {
+		32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+	};
+	static constexpr int    class_count = sizeof(cell_sizes) / sizeof(cell_sizes[0]);
+	static constexpr size_t max_cell_size = 1024;
+	static constexpr uint8_t large_class = 0xFF; // Not in a pool at all
+	static constexpr size_t chunk_size = 2 * 1024 * 1024;
+	Size_Class classes[Pool::class_count];
+	uint8_t class_for_size[Pool::max_cell_size / 16 + 1];
+	List<uint8_t*> chunks;
+	bool use_huge_pages = false;
+
+	void init()
+	{
+		int c = 0;
+		for (size_t units = 0; units <= Pool::max_cell_size / 16; units++) {
+			while (cell_sizes[c] < units * 16) c++;
+			class_for_size[units] = c;
+		}
+		for (int i = 0; i < Pool::class_count; i++) {
+			classes[i] = (Size_Class) { cell_sizes[i], NULL, NULL, NULL, NULL };
+		}
+		chunks.alloc();
+	}
+	void destroy_everything()
+	{
+		for (int i = 0; i < chunks.size; i++) {
+			munmap(chunks[i], Pool::chunk_size);
+		}
+		chunks.dealloc();
+	}
+	// Returns the size class that fits size bytes, or large_class
+	uint8_t size_class(size_t size)
+	{
+		if (size > Pool::max_cell_size) {
+			return Pool::large_class;
+		}
+		return class_for_size[(size + 15) / 16];
+	}
+	/** new_chunk
+	 * Chunks are aligned to their own size, which is a huge page, so
+	 * MADV_HUGEPAGE can back each one with exactly one. mmap only
+	 * promises page alignment, so this maps twice as much and trims
+	 * the ends.
+	 */
+	uint8_t * new_chunk()
+	{
+		void * mapping = mmap(NULL, Pool::chunk_size * 2, PROT_READ | PROT_WRITE,
+							  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) {
+			fatal("Out of memory");
+		}
+		uintptr_t start = (uintptr_t) mapping;
+		uintptr_t aligned = (start + Pool::chunk_size - 1) & ~(uintptr_t) (Pool::chunk_size - 1);
+		size_t head = aligned - start;
+		size_t tail = Pool::chunk_size - head;
+		if (head > 0) munmap(mapping, head);
+		if (tail > 0) munmap((void*) (aligned + Pool::chunk_size), tail);
+		void * chunk = (void*) aligned;
+#ifdef MADV_HUGEPAGE
+		if (use_huge_pages) {
+			madvise(chunk, Pool::chunk_size, MADV_HUGEPAGE);
+		}
+#endif
+		chunks.push((uint8_t*) chunk);
+		return (uint8_t*) chunk;
+	}
+	void * alloc_from_class(uint8_t index)
+	{
+		Size_Class * sc = &classes[index];
+		if (sc->free_list) {
+			Free_Cell * cell = sc->free_list;
+			sc->free_list = cell->next;
+			return (void*) cell;
+		}
+		if (__atomic_load_n(&sc->returned, __ATOMIC_RELAXED)) {
+			Free_Cell * cell = __atomic_exchange_n(&sc->returned, NULL, __ATOMIC_ACQUIRE);
+			sc->free_list = cell->next;
+			return (void*) cell;
+		}
+		if (sc->bump + sc->cell_size > sc->bump_limit) {
+			sc->bump = new_chunk();
+			sc->bump_limit = sc->bump + Pool::chunk_size;
+		}
+		void * cell = sc->bump;
+		sc->bump += sc->cell_size;
+		return cell;
+	}
+	void * alloc(size_t size, uint8_t index)
+	{
+		if (index == Pool::large_class) {
+			void * ptr = aligned_alloc(16, (size + 15) & ~(size_t) 15);
+			if (!ptr) fatal("Out of memory");
+			return ptr;
+		}
+		return alloc_from_class(index);
+	}
+	// Hands a cell back to its class, to be reused by the next alloc()
+	void release(void * ptr, uint8_t index)
+	{
+		if (index == Pool::large_class) {
+			free(ptr);
+			return;
+		}
+		Free_Cell * cell = (Free_Cell*) ptr;
+		cell->next = classes[index].free_list;
+		classes[index].free_list = cell;
+	}
+	/** give_back
+	 * Safe to call from any thread. Hands back a chain of cells from
+	 * one class, already linked from first to last.
+	 */
+	void give_back(uint8_t index, Free_Cell * first, Free_Cell * last)
+	{
+		Free_Cell ** returned = &classes[index].returned;
+		Free_Cell * head = __atomic_load_n(returned, __ATOMIC_RELAXED);
+		do {
+			last->next = head;
+		} while (!__atomic_compare_exchange_n(returned, &head, first, true,
+											  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
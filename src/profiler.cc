@@ -0,0 +1,149 @@
+/** Profiler
+ * Counts how often each opcode runs, how long it takes, and which
+ * opcode follows which. The VM calls step() on every dispatch, and
+ * the time between two dispatches is charged to the first one.
+ *
+ * The VM loops are templates on whether a profiler is attached, so
+ * none of this is compiled into the normal loop.
+ */
+struct Profiler {
+	const char * const * names;
+	int opcode_count;
+	uint64_t * counts;
+	uint64_t * ticks;
+	uint64_t * pairs; // pairs[a * opcode_count + b] counts a followed by b
+	int last_opcode;  // -1 at the start of a run
+	uint64_t last_tick;
+	static constexpr int report_pair_count = 20;
+	void alloc(const char * const * names, int opcode_count)
+	{
+		this->names = names;
+		this->opcode_count = opcode_count;
+		counts = (uint64_t*) calloc(opcode_count, sizeof(uint64_t));
+		ticks = (uint64_t*) calloc(opcode_count, sizeof(uint64_t));
+		pairs = (uint64_t*) calloc(opcode_count * opcode_count, sizeof(uint64_t));
+		last_opcode = -1;
+		last_tick = 0;
+	}
+	void dealloc()
+	{
+		free(counts);
+		free(ticks);
+		free(pairs);
+	}
+	void step(int opcode)
+	{
+		uint64_t tick = Timings::now();
+		if (last_opcode != -1) {
+			ticks[last_opcode] += tick - last_tick;
+			pairs[last_opcode * opcode_count + opcode]++;
+		}
+		counts[opcode]++;
+		last_opcode = opcode;
+		last_tick = tick;
+	}
+	// Called when a run halts; the next run starts a fresh sequence
+	void finish()
+	{
+		if (last_opcode != -1) {
+			ticks[last_opcode] += Timings::now() - last_tick;
+		}
+		last_opcode = -1;
+	}
+	static void write_percent(Sink * sink, uint64_t part, uint64_t total)
+	{
+		char buf[32];
+		sink->write(buf, snprintf(buf, sizeof(buf), "%6.2f%%",
+								  total ? 100.0 * part / total : 0.0));
+	}
+	static void write_padded(Sink * sink, const char * s, int width)
+	{
+		int length = strlen(s);
+		sink->write(s, length);
+		while (length++ < width) sink->put(' ');
+	}
+	static void write_number(Sink * sink, uint64_t n, int width)
+	{
+		char buf[32];
+		sink->write(buf, snprintf(buf, sizeof(buf), "%*llu", width, (unsigned long long) n));
+	}
+	/** report
+	 * Writes opcodes sorted by the time spent in them, then the most
+	 * common pairs.
+	 */
+	void report(Sink * sink)
+	{
+		uint64_t total_count = 0;
+		uint64_t total_ticks = 0;
+		List<int> order;
+		order.alloc();
+		for (int i = 0; i < opcode_count; i++) {
+			total_count += counts[i];
+			total_ticks += ticks[i];
+			if (counts[i] > 0) order.push(i);
+		}
+		// Few enough opcodes that insertion sort is fine
+		for (int i = 1; i < order.size; i++) {
+			int op = order[i];
+			int j = i;
+			while (j > 0 && ticks[order[j - 1]] < ticks[op]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = op;
+		}
+		sink->write("== Opcode profile ==\n");
+		sink->write("opcode                         executed   share        ticks   share  ticks/op\n");
+		for (int i = 0; i < order.size; i++) {
+			int op = order[i];
+			write_padded(sink, names[op], 28);
+			write_number(sink, counts[op], 11);
+			sink->put(' ');
+			write_percent(sink, counts[op], total_count);
+			write_number(sink, ticks[op], 13);
+			sink->put(' ');
+			write_percent(sink, ticks[op], total_ticks);
+			write_number(sink, ticks[op] / counts[op], 10);
+			sink->put('\n');
+		}
+		write_padded(sink, "total", 28);
+		write_number(sink, total_count, 11);
+		sink->write("         ");
+		write_number(sink, total_ticks, 13);
+		sink->put('\n');
+		order.dealloc();
+
+		// Pulls out the most common pairs one at a time, rather than
+		// sorting the whole square table
+		sink->write("\n== Most common opcode pairs ==\n");
+		uint64_t total_pairs = 0;
+		for (int i = 0; i < opcode_count * opcode_count; i++) {
+			total_pairs += pairs[i];
+		}
+		uint64_t previous_best = UINT64_MAX;
+		int previous_index = -1;
+		for (int n = 0; n < Profiler::report_pair_count; n++) {
+			int best = -1;
+			for (int i = 0; i < opcode_count * opcode_count; i++) {
+				if (pairs[i] == 0) continue;
+				// Ties are taken in index order
+				bool after_previous = pairs[i] < previous_best ||
+					(pairs[i] == previous_best && i > previous_index);
+				if (after_previous && (best == -1 || pairs[i] > pairs[best])) {
+					best = i;
+				}
+			}
+			if (best == -1) break;
+			write_padded(sink, names[best / opcode_count], 28);
+			sink->write(" -> ");
+			write_padded(sink, names[best % opcode_count], 28);
+			write_number(sink, pairs[best], 11);
+			sink->put(' ');
+			write_percent(sink, pairs[best], total_pairs);
+			sink->put('\n');
+			previous_best = pairs[best];
+			previous_index = best;
+		}
+		sink->flush();
+	}
+};
@@ -0,0 +1,343 @@
+/** Register-based bytecode
+ * An alternative to the stack instruction set. Instructions are
+ * three-address: operands name registers in the VM's register file,
+ * global slots, constants or counts directly, so temporaries never go
+ * through the op stack. Selected with --vm=register.
+ */
+
+#define REG_INSTR_LIST(X)						\
+	X(REG_HALT)									\
+	X(REG_LOAD_CONST)    /* a = constants[b] */	\
+	X(REG_LOAD_GLOBAL)   /* a = globals[b] */	\
+	X(REG_DEFINE_GLOBAL) /* globals[a] = b */	\
+	X(REG_STORE_GLOBAL)  /* globals[a] = b, checking the type */ \
+	X(REG_MAKE_TUPLE)    /* a = (b, b + 1, ..., b + c - 1) */ \
+	X(REG_VALIDATE_TYPE) /* check a is of type b */ \
+	X(REG_TYPEOF)        /* a = typeof b */		\
+	X(REG_OUTPUT)        /* print a */
+
+enum Reg_Instr_Type {
+#define X(name) name,
+	REG_INSTR_LIST(X)
+#undef X
+	REG_INSTR_COUNT,
+};
+
+// Without the REG_ prefix
+static const char * const reg_instr_names[REG_INSTR_COUNT] = {
+#define X(name) #name + 4,
+	REG_INSTR_LIST(X)
+#undef X
+};
+
+struct Reg_Instr {
+	Reg_Instr_Type type;
+	int a;
+	int b;
+	int c;
+	static Reg_Instr make(Reg_Instr_Type type, int a = 0, int b = 0, int c = 0)
+	{
+		return (Reg_Instr) { type, a, b, c };
+	}
+};
+
+/** Register_Compiler
+ * Compiles statements to register bytecode. Registers are handed out
+ * like a stack: every expression is compiled into a register picked by
+ * its parent, and its own temporaries come from above that. They're all
+ * free again at the end of each statement.
+ */
+struct Register_Compiler {
+	List<Reg_Instr> source;
+	List<Value> constants;
+	Symbol_Table * globals; // Owned by the VM; we only hand out slots
+	int next_register;
+	int register_count; // The most registers any statement needed
+	void alloc(Symbol_Table * globals)
+	{
+		source.alloc();
+		constants.alloc();
+		this->globals = globals;
+		next_register = 0;
+		register_count = 0;
+	}
+	void dealloc()
+	{
+		source.dealloc();
+		constants.dealloc();
+	}
+	void finish()
+	{
+		source.push(Reg_Instr::make(REG_HALT));
+	}
+	int new_register()
+	{
+		int reg = next_register++;
+		if (next_register > register_count) {
+			register_count = next_register;
+		}
+		return reg;
+	}
+	int add_constant(Value value)
+	{
+		constants.push(value);
+		return constants.size - 1;
+	}
+	void compile_expr(Expr * expr, int dest)
+	{
+		switch (expr->type) {
+		case EXPR_TYPEOF: {
+			compile_expr(expr->type_of.expr, dest);
+			source.push(Reg_Instr::make(REG_TYPEOF, dest, dest));
+		} break;
+		case EXPR_VARIABLE: {
+			int slot = globals->find(expr->variable);
+			if (slot == -1) {
+				fatal("Tried to lookup nonexistent variable %s", expr->variable);
+			}
+			source.push(Reg_Instr::make(REG_LOAD_GLOBAL, dest, slot));
+		} break;
+		case EXPR_INTEGER: {
+			int k = add_constant(Value::make_integer(expr->integer));
+			source.push(Reg_Instr::make(REG_LOAD_CONST, dest, k));
+		} break;
+		case EXPR_STRING: {
+			int k = add_constant(Value::make_string_from_intern(expr->string));
+			source.push(Reg_Instr::make(REG_LOAD_CONST, dest, k));
+		} break;
+		case EXPR_TUPLE: {
+			if (Constants::is_constant(expr)) {
+				int k = add_constant(Constants::materialize(expr));
+				source.push(Reg_Instr::make(REG_LOAD_CONST, dest, k));
+				break;
+			}
+			// Elements go in consecutive registers
+			int first = next_register;
+			for (int i = 0; i < expr->tuple.size; i++) {
+				new_register();
+			}
+			for (int i = 0; i < expr->tuple.size; i++) {
+				compile_expr(expr->tuple[i], first + i);
+			}
+			source.push(Reg_Instr::make(REG_MAKE_TUPLE, dest, first, expr->tuple.size));
+			next_register = first;
+		} break;
+		default:
+			fatal_internal("Switch in Register_Compiler::compile_expr() incomplete");
+			break;
+		}
+	}
+	void compile_stmt(Stmt * stmt)
+	{
+		next_register = 0;
+		switch (stmt->type) {
+		case STMT_LET: {
+			const char * symbol = stmt->let.symbol;
+			if (globals->find(symbol) != -1) {
+				fatal("Tried to declare variable %s which is already bound", symbol);
+			}
+			Static_Type static_type;
+			bool validate = Type_Check::check_let(globals, stmt, &static_type);
+			int value = new_register();
+			compile_expr(stmt->let.right, value);
+			if (validate) {
+				int type = new_register();
+				compile_expr(stmt->let.annotation, type);
+				source.push(Reg_Instr::make(REG_VALIDATE_TYPE, value, type));
+			}
+			int slot = globals->declare(symbol, static_type);
+			source.push(Reg_Instr::make(REG_DEFINE_GLOBAL, slot, value));
+		} break;
+		case STMT_ASSIGN: {
+			// Only specific expressions are valid l-expressions
+			if (stmt->assign.left->type == EXPR_VARIABLE) {
+				// Variable assignment
+				const char * symbol = stmt->assign.left->variable;
+				int slot = globals->find(symbol);
+				if (slot == -1) {
+					fatal("Tried to modify nonexistent variable %s", symbol);
+				}
+				bool checked = Type_Check::check_store(globals, slot, stmt->assign.right);
+				int value = new_register();
+				compile_expr(stmt->assign.right, value);
+				source.push(Reg_Instr::make(checked ? REG_STORE_GLOBAL : REG_DEFINE_GLOBAL,
+											slot, value));
+			} else {
+				fatal("Invalid l-expression");
+			}
+		} break;
+		case STMT_PRINT: {
+			int value = new_register();
+			compile_expr(stmt->print.expr, value);
+			source.push(Reg_Instr::make(REG_OUTPUT, value));
+		} break;
+		case STMT_EXPR: {
+			compile_expr(stmt->expr, new_register());
+		} break;
+		default:
+			fatal_internal("Switch in Register_Compiler::compile_stmt() incomplete");
+			break;
+		}
+	}
+	void disassemble(Sink * sink);
+	void execute(VM * vm);
+};
+
+void VM::prime_registers(Reg_Instr * program, Value * constants, int register_count)
+{
+	register_program = program;
+	this->constants = constants;
+	program_counter = 0;
+	halted = false;
+	// Stale values would keep objects alive, so start from scratch
+	registers.clear();
+	for (int i = 0; i < register_count; i++) {
+		registers.push(Value::make_integer(0));
+	}
+}
+
+void VM::run_registers()
+{
+	if (profiler) {
+		run_registers_loop<true>();
+	} else {
+		run_registers_loop<false>();
+	}
+}
+
+template <bool Profile>
+void VM::run_registers_loop()
+{
+	Reg_Instr * instr;
+	Value * r = registers.arr;
+#if MARCH_THREADED_DISPATCH
+	static void * dispatch_table[REG_INSTR_COUNT] = {
+#define X(name) &&LABEL_##name,
+		REG_INSTR_LIST(X)
+#undef X
+	};
+#define CASE(name) LABEL_##name:
+#define NEXT() instr = &register_program[program_counter++];			\
+		if (Profile) profiler->step(instr->type);						\
+		goto *dispatch_table[instr->type]
+	NEXT();
+#else
+#define CASE(name) case name:
+#define NEXT() continue
+	while (true) {
+	instr = &register_program[program_counter++];
+	if (Profile) profiler->step(instr->type);
+	switch (instr->type) {
+#endif
+	CASE(REG_HALT) {
+		if (Profile) profiler->finish();
+		halted = true;
+		return;
+	}
+	CASE(REG_LOAD_CONST) {
+		r[instr->a] = constants[instr->b];
+		NEXT();
+	}
+	CASE(REG_LOAD_GLOBAL) {
+		r[instr->a] = global_table.values[instr->b];
+		NEXT();
+	}
+	CASE(REG_DEFINE_GLOBAL) {
+		write_barrier(instr->a, r[instr->b]);
+		global_table.values[instr->a] = r[instr->b];
+		NEXT();
+	}
+	CASE(REG_STORE_GLOBAL) {
+		Value * slot = &global_table.values[instr->a];
+		if (!r[instr->b].validate_type(slot->get_annotation())) {
+			fatal("Mismatch between expected and provided type");
+		}
+		write_barrier(instr->a, r[instr->b]);
+		*slot = r[instr->b];
+		NEXT();
+	}
+	CASE(REG_MAKE_TUPLE) {
+		// The register file is a root, so this is a safe point
+		if (Collection::wants_collection()) {
+			collect_garbage();
+		}
+		Obj_Tuple * tuple = Obj_Tuple::alloc(instr->c);
+		memcpy(tuple->elements, &r[instr->b], sizeof(Value) * instr->c);
+		r[instr->a] = Value::make_reference(tuple);
+		NEXT();
+	}
+	CASE(REG_VALIDATE_TYPE) {
+		assert(r[instr->b].type == VALUE_TYPE);
+		if (!r[instr->a].validate_type(r[instr->b].annotation)) {
+			fatal("Mismatch between expected and provided type");
+		}
+		NEXT();
+	}
+	CASE(REG_TYPEOF) {
+		r[instr->a] = Value::make_type(r[instr->b].get_annotation());
+		NEXT();
+	}
+	CASE(REG_OUTPUT) {
+		r[instr->a].print_to(&output);
+		output.put('\n');
+		if (flush_every_line) output.flush();
+		NEXT();
+	}
+#if !MARCH_THREADED_DISPATCH
+	default:
+		fatal_internal("Invalid instruction %d in VM::run_registers()", instr->type);
+		break;
+	}
+	}
+#endif
+#undef CASE
+#undef NEXT
+}
+
+void Register_Compiler::disassemble(Sink * sink)
+{
+	char buf[64];
+	for (int i = 0; i < source.size; i++) {
+		Reg_Instr * instr = &source[i];
+		const char * format = instr->type == REG_HALT ? "%04d  %s" : "%04d  %-16s";
+		sink->write(buf, snprintf(buf, sizeof(buf), format, i,
+								  reg_instr_names[instr->type]));
+		switch (instr->type) {
+		case REG_LOAD_CONST:
+			sink->write(buf, snprintf(buf, sizeof(buf), "r%d, ", instr->a));
+			Disassembler::write_constant(sink, constants[instr->b]);
+			break;
+		case REG_LOAD_GLOBAL:
+			sink->write(buf, snprintf(buf, sizeof(buf), "r%d, ", instr->a));
+			Disassembler::write_slot(sink, globals, instr->b);
+			break;
+		case REG_DEFINE_GLOBAL:
+		case REG_STORE_GLOBAL:
+			Disassembler::write_slot(sink, globals, instr->a);
+			sink->write(buf, snprintf(buf, sizeof(buf), ", r%d", instr->b));
+			break;
+		case REG_MAKE_TUPLE:
+			sink->write(buf, snprintf(buf, sizeof(buf), "r%d, r%d..r%d", instr->a,
+									  instr->b, instr->b + instr->c - 1));
+			break;
+		case REG_VALIDATE_TYPE:
+		case REG_TYPEOF:
+			sink->write(buf, snprintf(buf, sizeof(buf), "r%d, r%d", instr->a, instr->b));
+			break;
+		case REG_OUTPUT:
+			sink->write(buf, snprintf(buf, sizeof(buf), "r%d", instr->a));
+			break;
+		default:
+			break;
+		}
+		sink->put('\n');
+	}
+	sink->put('\n');
+	sink->flush();
+}
+
+void Register_Compiler::execute(VM * vm)
+{
+	vm->prime_registers(source.arr, constants.arr, register_count);
+	vm->run_registers();
+}
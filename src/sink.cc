@@ -0,0 +1,120 @@
+/** Sink
+ * Somewhere to stream formatted output to. Writes land in buffer; a
+ * sink with a file descriptor write()s the buffer out when it fills
+ * up, and a sink without one (fd == -1) just grows, so that it can be
+ * used to build strings.
+ */
+struct Sink {
+	char * buffer;
+	size_t length;
+	size_t capacity;
+	int fd;
+	static constexpr size_t default_capacity = 4096;
+	void alloc(int fd = -1, size_t capacity = Sink::default_capacity);
+	void dealloc();
+	void flush();
+	void write(const char * s, size_t n);
+	void write(const char * s);
+	void put(char c);
+	void write_int(int integer);
+	void write_pointer(void * ptr);
+	char * take_string();
+};
+
+void Sink::alloc(int fd, size_t capacity)
+{
+	this->fd = fd;
+	this->capacity = capacity;
+	length = 0;
+	buffer = (char*) malloc(capacity);
+}
+
+void Sink::dealloc()
+{
+	flush();
+	free(buffer);
+	buffer = NULL;
+	capacity = 0;
+}
+
+// Writes out everything buffered so far. Does nothing for a sink
+// without a file descriptor.
+void Sink::flush()
+{
+	if (fd == -1) return;
+	size_t written = 0;
+	while (written < length) {
+		ssize_t got = ::write(fd, buffer + written, length - written);
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			break; // Nowhere left to report this to
+		}
+		written += got;
+	}
+	length = 0;
+}
+
+void Sink::write(const char * s, size_t n)
+{
+	if (n > capacity - length) {
+		if (fd != -1) {
+			flush();
+			if (n >= capacity) {
+				// Too big to be worth copying through the buffer
+				length = n;
+				char * saved = buffer;
+				buffer = (char*) s;
+				flush();
+				buffer = saved;
+				return;
+			}
+		} else {
+			while (n > capacity - length) capacity *= 2;
+			buffer = (char*) realloc(buffer, capacity);
+		}
+	}
+	memcpy(buffer + length, s, n);
+	length += n;
+}
+
+void Sink::write(const char * s)
+{
+	write(s, strlen(s));
+}
+
+void Sink::put(char c)
+{
+	if (length == capacity) {
+		write(&c, 1);
+		return;
+	}
+	buffer[length++] = c;
+}
+
+void Sink::write_int(int integer)
+{
+	char buf[16];
+	write(buf, format_int(integer, buf));
+}
+
+void Sink::write_pointer(void * ptr)
+{
+	char buf[32];
+	write(buf, snprintf(buf, sizeof(buf), "%p", ptr));
+}
+
+/** take_string
+ * For sinks without a file descriptor: hands back everything written
+ * as a NUL-terminated, malloc'd string, and leaves the sink empty and
+ * deallocated.
+ */
+char * Sink::take_string()
+{
+	assert(fd == -1);
+	put('\0');
+	char * s = buffer;
+	buffer = NULL;
+	capacity = 0;
+	length = 0;
+	return s;
+}
@@ -20,9 +20,7 @@ String_Builder::~String_Builder()
 
 void String_Builder::append(const char * s)
 {
-	for (int i = 0; i < strlen(s); i++) {
-		builder.push(s[i]);
-	}
+	builder.append(s, strlen(s));
 }
 
 char * String_Builder::final_string()
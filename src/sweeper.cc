@@ -0,0 +1,112 @@
+/** Sweeper
+ * Frees dead objects on a background thread, so the pause only has to
+ * find them. After each collection the VM hands over the doomed list,
+ * and the sweeper links the cells of each size class into a chain and
+ * gives it back to Pool in one go. Large objects are just free()'d.
+ *
+ * Dead objects can't be reached by anything, so the sweeper is free to
+ * scribble on them while the interpreter carries on.
+ *
+ * If the thread can't be started, batches are freed on the spot
+ * instead.
+ */
+namespace Sweeper {
+	using Collection::Obj_Header;
+	// Handed over but not yet picked up by the thread
+	List<Obj_Header*> pending;
+	pthread_t thread;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+	bool running;
+	bool stopping;
+	void release_batch(List<Obj_Header*> * batch)
+	{
+		Pool::Free_Cell * first[Pool::class_count] = {};
+		Pool::Free_Cell * last[Pool::class_count] = {};
+		for (int i = 0; i < batch->size; i++) {
+			Obj_Header * header = (*batch)[i];
+			uint8_t index = header->size_class;
+			if (index == Pool::large_class) {
+				Pool::release(header, Pool::large_class);
+				continue;
+			}
+			Pool::Free_Cell * cell = (Pool::Free_Cell*) header;
+			cell->next = first[index];
+			first[index] = cell;
+			if (!last[index]) last[index] = cell;
+		}
+		for (int i = 0; i < Pool::class_count; i++) {
+			if (first[i]) {
+				Pool::give_back(i, first[i], last[i]);
+			}
+		}
+	}
+	void * sweeper_main(void * arg)
+	{
+		List<Obj_Header*> batch;
+		batch.alloc();
+		batch.shrinks = false;
+		pthread_mutex_lock(&lock);
+		while (true) {
+			while (pending.size == 0 && !stopping) {
+				pthread_cond_wait(&wake, &lock);
+			}
+			if (pending.size == 0) break;
+			List<Obj_Header*> swap = batch;
+			batch = pending;
+			pending = swap;
+			pthread_mutex_unlock(&lock);
+			release_batch(&batch);
+			batch.clear();
+			pthread_mutex_lock(&lock);
+		}
+		pthread_mutex_unlock(&lock);
+		batch.dealloc();
+		return NULL;
+	}
+	void init()
+	{
+		pending.alloc();
+		pending.shrinks = false;
+		stopping = false;
+		running = pthread_create(&thread, NULL, sweeper_main, NULL) == 0;
+	}
+	/** hand_off
+	 * Takes the contents of a doomed list to be freed, leaving it
+	 * empty.
+	 */
+	void hand_off(List<Obj_Header*> * doomed)
+	{
+		if (doomed->size == 0) return;
+		if (!running) {
+			release_batch(doomed);
+			doomed->clear();
+			return;
+		}
+		pthread_mutex_lock(&lock);
+		if (pending.size == 0) {
+			// Usual case: the thread has caught up, so just swap
+			List<Obj_Header*> swap = pending;
+			pending = *doomed;
+			*doomed = swap;
+		} else {
+			pending.append(doomed->arr, doomed->size);
+			doomed->clear();
+		}
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+	}
+	// Waits for everything handed over so far to be freed
+	void shutdown()
+	{
+		if (running) {
+			pthread_mutex_lock(&lock);
+			stopping = true;
+			pthread_cond_signal(&wake);
+			pthread_mutex_unlock(&lock);
+			pthread_join(thread, NULL);
+			running = false;
+		}
+		pending.dealloc();
+	}
+}
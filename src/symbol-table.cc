@@ -1,41 +1,120 @@
+/** Static_Type
+ * What the compiler knows about a value before the program runs. A
+ * NULL type means it isn't known. Values of type `type` are types
+ * themselves, and value says which one, if that's known too.
+ */
+struct Static_Type {
+	const Type_Annotation * type;
+	const Type_Annotation * value;
+	static Static_Type unknown()
+	{
+		return (Static_Type) { NULL, NULL };
+	}
+	static Static_Type of(const Type_Annotation * type)
+	{
+		return (Static_Type) { type, NULL };
+	}
+	// Exactly what's known about a value that's already been computed
+	static Static_Type of_value(Value value)
+	{
+		Static_Type known = Static_Type::of(value.get_annotation());
+		if (value.type == VALUE_TYPE) {
+			known.value = value.annotation;
+		}
+		return known;
+	}
+};
+
 /** Symbol_Table
- * A structure that binds symbols to Values.
+ * A structure that binds symbols to Values. Every symbol gets a fixed
+ * slot the first time it's declared, so that the compiler can resolve
+ * symbols ahead of time and the VM can just index into values.
+ *
+ * This only works on strings that have been interned! i.e. Symbols
+ * and string literals. Constructed strings have no guarantee to
+ * compare correctly, since we key on the pointer itself.
+ *
+ * Each slot also carries its Static_Type, for Type_Check. That's
+ * compile-time knowledge, so it's kept up to date by the compilers
+ * rather than the VM.
  */
 struct Symbol_Table {
 	List<const char*> symbols;
 	List<Value>       values;
+	List<Static_Type> static_types;
+	int * index;           // Open-addressing table of slots, -1 if empty
+	size_t index_capacity; // Always a power of two
+	static constexpr size_t initial_index_capacity = 64;
 	void alloc()
 	{
 		symbols.alloc();
 		values.alloc();
+		static_types.alloc();
+		index_capacity = Symbol_Table::initial_index_capacity;
+		index = (int*) malloc(sizeof(int) * index_capacity);
+		memset(index, -1, sizeof(int) * index_capacity);
 	}
 	void dealloc()
 	{
 		symbols.dealloc();
 		values.dealloc();
+		static_types.dealloc();
+		free(index);
 	}
-	int find(const char * symbol)
+	static size_t hash_symbol(const char * symbol)
 	{
+		uintptr_t h = (uintptr_t) symbol;
+		h ^= h >> 17;
+		h *= 0x9E3779B97F4A7C15ull;
+		return (size_t) (h ^ (h >> 29));
+	}
+	size_t probe(const char * symbol)
+	{
+		size_t slot = hash_symbol(symbol) & (index_capacity - 1);
+		while (index[slot] != -1 && symbols[index[slot]] != symbol) {
+			slot = (slot + 1) & (index_capacity - 1);
+		}
+		return slot;
+	}
+	void grow_index()
+	{
+		free(index);
+		index_capacity *= 2;
+		index = (int*) malloc(sizeof(int) * index_capacity);
+		memset(index, -1, sizeof(int) * index_capacity);
 		for (int i = 0; i < symbols.size; i++) {
-			if (symbols[i] == symbol) { // This only works on string
-										// that have been interned!
-										// i.e. Symbols and string
-										// literals. Constructed
-										// strings have no guarantee
-										// to dereference corrrectly!
-				return i;
-			}
+			index[probe(symbols[i])] = i;
+		}
+	}
+	int find(const char * symbol)
+	{
+		return index[probe(symbol)];
+	}
+	/** declare
+	 * Gives symbol a new slot and returns it. The slot holds a
+	 * meaningless placeholder until something is stored into it, and
+	 * type is what the compiler knows about that.
+	 */
+	int declare(const char * symbol, Static_Type type = Static_Type::unknown())
+	{
+		assert(find(symbol) == -1);
+		if ((symbols.size + 1) * 2 > index_capacity) {
+			grow_index();
 		}
-		return -1;
+		int slot = symbols.size;
+		symbols.push(symbol);
+		values.push(Value::make_integer(0));
+		static_types.push(type);
+		index[probe(symbol)] = slot;
+		return slot;
 	}
 	void set(const char * symbol, Value value)
 	{
-		int index = find(symbol);
-		if (index == -1) {
-			symbols.push(symbol);
-			values.push(value);
-		} else {
-			values[index] = value;
+		int slot = find(symbol);
+		if (slot == -1) {
+			slot = declare(symbol);
 		}
+		values[slot] = value;
+		static_types[slot] = Static_Type::of_value(value);
 	}
 };
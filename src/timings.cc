@@ -0,0 +1,78 @@
+/** Timings
+ * Wall-clock time spent in each phase of a run, for --timings. Phases
+ * are timed in TSC ticks where there's a TSC, since they're cheap
+ * enough to read around every token, and converted to nanoseconds at
+ * the end against the clock.
+ *
+ * Lexing happens inside parsing and collecting inside executing, so
+ * parse and execute are reported without them.
+ */
+namespace Timings {
+	bool enabled = false;
+	uint64_t lex;
+	uint64_t parse;   // Including lex
+	uint64_t compile;
+	uint64_t cache;   // Loading or saving the bytecode cache
+	uint64_t execute; // Including gc
+	uint64_t gc;
+	size_t collections;
+	uint64_t start_ticks;
+	struct timespec start_time;
+
+	uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	}
+	void init()
+	{
+		enabled = true;
+		lex = parse = compile = cache = execute = gc = 0;
+		collections = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		start_ticks = now();
+	}
+	// Returns 0 when disabled, so that callers don't need to check
+	uint64_t begin()
+	{
+		return enabled ? now() : 0;
+	}
+	void end(uint64_t * phase, uint64_t started)
+	{
+		if (enabled) *phase += now() - started;
+	}
+	/** report
+	 * Writes one JSON object on one line, with every phase in
+	 * milliseconds.
+	 */
+	void report(Sink * sink, const char * path)
+	{
+		uint64_t total_ticks = now() - start_ticks;
+		struct timespec end_time;
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+		double total_ns = (end_time.tv_sec - start_time.tv_sec) * 1e9 +
+			(end_time.tv_nsec - start_time.tv_nsec);
+		double ms_per_tick = total_ticks ? total_ns / total_ticks / 1e6 : 0;
+		char buf[512];
+		sink->write("{\"file\":\"");
+		// Paths only need escaping for quotes and backslashes
+		for (const char * c = path; *c; c++) {
+			if (*c == '"' || *c == '\\') sink->put('\\');
+			sink->put(*c);
+		}
+		sink->write(buf, snprintf(
+			buf, sizeof(buf),
+			"\",\"lex_ms\":%.3f,\"parse_ms\":%.3f,\"compile_ms\":%.3f,"
+			"\"cache_ms\":%.3f,\"execute_ms\":%.3f,\"gc_ms\":%.3f,"
+			"\"collections\":%zu,\"total_ms\":%.3f}\n",
+			lex * ms_per_tick, (parse - lex) * ms_per_tick, compile * ms_per_tick,
+			cache * ms_per_tick, (execute - gc) * ms_per_tick, gc * ms_per_tick,
+			collections, total_ns / 1e6));
+		sink->flush();
+	}
+}
@@ -0,0 +1,112 @@
+/** Type_Check
+ * Works out types at compile time, so the compilers can leave out
+ * runtime checks that can't fail, and report the ones that must fail
+ * before anything runs.
+ *
+ * A global's type is fixed by its first value, since every later
+ * store is checked against it. Programs are straight-line, so the
+ * checker sees every store in the order it will run, and it can
+ * follow which type each `type` global holds as well. That's what
+ * proves annotations like `let x : int = 5;`, since `int` is just a
+ * global. Anything it can't work out is left unknown, and the runtime
+ * check stays.
+ */
+namespace Type_Check {
+	bool enabled = true;
+
+	// The same test as Value::validate_type(), on types alone
+	bool matches(const Type_Annotation * actual, const Type_Annotation * expected)
+	{
+		if (actual->val_type != VALUE_REFERENCE) {
+			return actual->val_type == expected->val_type;
+		}
+		return expected->val_type == VALUE_REFERENCE && actual->obj_type == expected->obj_type;
+	}
+	Static_Type infer(Symbol_Table * globals, Expr * expr)
+	{
+		switch (expr->type) {
+		case EXPR_TYPEOF: {
+			Static_Type inner = infer(globals, expr->type_of.expr);
+			Static_Type type = Static_Type::of(Type_Annotation::primitive(VALUE_TYPE));
+			type.value = inner.type;
+			return type;
+		}
+		case EXPR_VARIABLE: {
+			int slot = globals->find(expr->variable);
+			if (slot == -1) {
+				fatal("Tried to lookup nonexistent variable %s", expr->variable);
+			}
+			return globals->static_types[slot];
+		}
+		case EXPR_INTEGER:
+			return Static_Type::of(Type_Annotation::primitive(VALUE_INTEGER));
+		case EXPR_STRING:
+			return Static_Type::of(Type_Annotation::primitive(VALUE_STRING));
+		case EXPR_TUPLE: {
+			// Tuple types don't depend on the elements, but they
+			// still have to be looked at for undefined variables
+			for (int i = 0; i < expr->tuple.size; i++) {
+				infer(globals, expr->tuple[i]);
+			}
+			return Static_Type::of(Type_Annotation::reference(OBJ_TUPLE));
+		}
+		default:
+			return Static_Type::unknown();
+		}
+	}
+	/** check_let
+	 * Sets bound to what will be known about the new variable, and
+	 * returns whether its annotation still has to be checked at
+	 * runtime.
+	 */
+	bool check_let(Symbol_Table * globals, Stmt * stmt, Static_Type * bound)
+	{
+		if (!enabled) {
+			*bound = Static_Type::unknown();
+			return !stmt->let.infer;
+		}
+		*bound = infer(globals, stmt->let.right);
+		if (stmt->let.infer) {
+			return false;
+		}
+		Static_Type annotation = infer(globals, stmt->let.annotation);
+		if (annotation.type && annotation.type->val_type != VALUE_TYPE) {
+			fatal("Annotation on %s isn't a type", stmt->let.symbol);
+		}
+		if (!annotation.value) {
+			return true;
+		}
+		if (!bound->type) {
+			// Once the check has passed, the annotation is the type
+			*bound = Static_Type::of(annotation.value);
+			return true;
+		}
+		if (!matches(bound->type, annotation.value)) {
+			fatal("Mismatch between expected and provided type");
+		}
+		return false;
+	}
+	/** check_store
+	 * Called when right is about to be stored into slot. Returns
+	 * whether the store still has to check the type at runtime.
+	 */
+	bool check_store(Symbol_Table * globals, int slot, Expr * right)
+	{
+		if (!enabled) {
+			return true;
+		}
+		Static_Type value = infer(globals, right);
+		Static_Type * target = &globals->static_types[slot];
+		if (!value.type || !target->type) {
+			// If the check passes, the type is whichever one is known
+			if (!target->type) target->type = value.type;
+			target->value = value.value;
+			return true;
+		}
+		if (!matches(value.type, target->type)) {
+			fatal("Mismatch between expected and provided type");
+		}
+		target->value = value.value;
+		return false;
+	}
+}
@@ -1,21 +1,105 @@
-char * load_string_from_file(char * path)
+/** Source_Text
+ * The contents of a source file. Not NUL-terminated! Regular files
+ * are mapped straight into memory; anything else (pipes, "-" for
+ * stdin) is read in big chunks into a malloc'd buffer.
+ */
+struct Source_Text {
+	const char * data;
+	size_t length;
+	bool mapped;
+	static bool load(const char * path, Source_Text * text);
+	void unload();
+};
+
+bool Source_Text::load(const char * path, Source_Text * text)
+{
+	int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd == -1) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			if (fd != STDIN_FILENO) close(fd);
+			text->data = (const char*) data;
+			text->length = info.st_size;
+			text->mapped = true;
+			return true;
+		}
+	}
+
+	size_t capacity = 64 * 1024;
+	size_t length = 0;
+	char * buf = (char*) malloc(capacity);
+	while (true) {
+		if (length == capacity) {
+			capacity *= 2;
+			buf = (char*) realloc(buf, capacity);
+		}
+		ssize_t got = read(fd, buf + length, capacity - length);
+		if (got == 0) break;
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			free(buf);
+			if (fd != STDIN_FILENO) close(fd);
+			return false;
+		}
+		length += got;
+	}
+	if (fd != STDIN_FILENO) close(fd);
+	text->data = buf;
+	text->length = length;
+	text->mapped = false;
+	return true;
+}
+
+void Source_Text::unload()
+{
+	if (mapped) {
+		munmap((void*) data, length);
+	} else {
+		free((void*) data);
+	}
+	data = NULL;
+	length = 0;
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/** format_int
+ * Writes integer in decimal to out, which needs room for at least 11
+ * characters, and returns how many were written. Not NUL-terminated.
+ */
+size_t format_int(int integer, char * out)
 {
-	FILE * file = fopen(path, "r");
-	if (file == NULL) return NULL;
-	int file_len = 0;
-	while (fgetc(file) != EOF) file_len++;
-	char * str = (char*) malloc(file_len + 1);
-	str[file_len] = '\0';
-	fseek(file, 0, SEEK_SET);
-	for (int i = 0; i < file_len; i++) str[i] = fgetc(file);
-	fclose(file);
-	return str;
+	char buf[16];
+	char * p = buf + sizeof(buf);
+	uint32_t n = integer < 0 ? 0u - (uint32_t) integer : (uint32_t) integer;
+	while (n >= 100) {
+		uint32_t pair = (n % 100) * 2;
+		n /= 100;
+		*--p = digit_pairs[pair + 1];
+		*--p = digit_pairs[pair];
+	}
+	if (n >= 10) {
+		*--p = digit_pairs[n * 2 + 1];
+		*--p = digit_pairs[n * 2];
+	} else {
+		*--p = '0' + n;
+	}
+	if (integer < 0) *--p = '-';
+	size_t length = buf + sizeof(buf) - p;
+	memcpy(out, p, length);
+	return length;
 }
 
 char * itoa(int integer)
 {
-	size_t size = snprintf(NULL, 0, "%d", integer);
-	char * buf = (char*) malloc(sizeof(char) * (size + 1));
-	sprintf(buf, "%d", integer);
+	char * buf = (char*) malloc(sizeof(char) * 16);
+	buf[format_int(integer, buf)] = '\0';
 	return buf;
 }
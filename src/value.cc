@@ -35,68 +35,93 @@ const char * obj_type_to_string(Obj_Type type)
  * check obj_type. If that's anything but OBJ_INSTANCE, then
  * class_name means nothing. Otherwise, we have a reference to a class
  * instance with name class_name.
+ *
+ * Annotations are shared: type values just point at one, so they're
+ * never built on the fly. Instances will need their own table once
+ * classes exist.
  */
 struct Type_Annotation {
 	Value_Type val_type;
 	Obj_Type obj_type;
 	const char * class_name;
-	static Type_Annotation make_primitive(Value_Type val_type)
+	static const Type_Annotation * primitive(Value_Type val_type);
+	static const Type_Annotation * reference(Obj_Type obj_type);
+	void print_to(Sink * sink) const
 	{
-		return (Type_Annotation) { val_type };
-	}
-	static Type_Annotation make_reference(Obj_Type obj_type)
-	{
-		return (Type_Annotation) { VALUE_REFERENCE, obj_type };
-	}
-	static Type_Annotation make_instance(const char * class_name)
-	{
-		return (Type_Annotation) { VALUE_REFERENCE, OBJ_INSTANCE, class_name };
-	}
-	char * to_string()
-	{
-		String_Builder builder;
-		builder.append("<type: ");
+		sink->write("<type: ");
 		switch (val_type) {
 		case VALUE_INTEGER:
-			builder.append("int");
+			sink->write("int");
 			break;
 		case VALUE_STRING:
-			builder.append("string");
+			sink->write("string");
 			break;
 		case VALUE_TYPE:
-			builder.append("type");
+			sink->write("type");
 			break;
 		case VALUE_REFERENCE:
-			builder.append(obj_type_to_string(obj_type));
+			sink->write(obj_type_to_string(obj_type));
 			break;
 		default:
-			fatal("Incomplete switch in Type_Annotation::to_string()");
+			fatal("Incomplete switch in Type_Annotation::print_to()");
 		}
-		builder.append(">");
-		return builder.final_string();
+		sink->put('>');
+	}
+	char * to_string() const
+	{
+		Sink sink;
+		sink.alloc();
+		print_to(&sink);
+		return sink.take_string();
 	}
 };
 
+static const Type_Annotation primitive_annotations[VALUE_PRIMITIVE_COUNT] = {
+	{ VALUE_INTEGER }, { VALUE_STRING }, { VALUE_TYPE },
+};
+
+static const Type_Annotation reference_annotations[OBJ_BUILTIN_COUNT] = {
+	{ VALUE_REFERENCE, OBJ_TUPLE },
+};
+
+const Type_Annotation * Type_Annotation::primitive(Value_Type val_type)
+{
+	assert(val_type < VALUE_PRIMITIVE_COUNT);
+	return &primitive_annotations[val_type];
+}
+
+const Type_Annotation * Type_Annotation::reference(Obj_Type obj_type)
+{
+	assert(obj_type < OBJ_BUILTIN_COUNT);
+	return &reference_annotations[obj_type];
+}
+
 /** Reference
  * Represents a reference type in the language --- should be kept as
  * tight as possible, because the size of this is passed around in
- * every kind of value.
+ * every kind of value. It's just the pointer; the object type lives in
+ * the object's header.
  */
 struct Reference {
-	Obj_Type type;
 	void * ptr;
+	Obj_Type type()
+	{
+		return (Obj_Type) Collection::header_of(ptr)->kind;
+	}
+	void print_to(Sink * sink);
 	char * to_string();
 	void mark_for_gc();
-	static Reference to(void * ptr, Obj_Type type)
+	static Reference to(void * ptr)
 	{
-		return (Reference) { type, ptr };
+		return (Reference) { ptr };
 	}
-	bool validate_type(Type_Annotation expected)
+	bool validate_type(const Type_Annotation * expected)
 	{
+		Obj_Type type = this->type();
 		if (type != OBJ_INSTANCE) {
-			return type == expected.obj_type;
+			return type == expected->obj_type;
 		} else {
-			if (expected.obj_type != OBJ_INSTANCE) {
+			if (expected->obj_type != OBJ_INSTANCE) {
 				return false;
 			} else {
 				assert(false && "This is impossible. Literally.");
@@ -107,7 +132,8 @@ struct Reference {
 
 /** Value
  * Represents a pass-by-value value. This is *never* pointed to,
- * always passed around by value.
+ * always passed around by value. Every payload fits in one word, so
+ * the whole thing is two words.
  */
 struct Value {
 	Value_Type type;
@@ -116,7 +142,7 @@ struct Value {
 		const char * string; // Strings are immutable, so they don't
 							 // need to be reference types
 		Reference reference;
-		Type_Annotation annotation;
+		const Type_Annotation * annotation;
 	};
 	static Value with_type(Value_Type type)
 	{
@@ -140,26 +166,38 @@ struct Value {
 		value.string = string;
 		return value;
 	}
+	static Value make_type(const Type_Annotation * annotation)
+	{
+		Value value = Value::with_type(VALUE_TYPE);
+		value.annotation = annotation;
+		return value;
+	}
+	static Value make_reference(void * ptr)
+	{
+		Value value = Value::with_type(VALUE_REFERENCE);
+		value.reference = Reference::to(ptr);
+		return value;
+	}
 	void mark_for_gc();
+	void print_to(Sink * sink);
 	char * to_string();
-	Type_Annotation get_annotation()
+	const Type_Annotation * get_annotation()
 	{
-		Type_Annotation annot;
-		annot.val_type = type;
 		if (type == VALUE_REFERENCE) {
-			annot.obj_type = reference.type;
-			if (reference.type == OBJ_INSTANCE) {
+			Obj_Type obj_type = reference.type();
+			if (obj_type == OBJ_INSTANCE) {
 				fatal("Unimplemented");
 			}
+			return Type_Annotation::reference(obj_type);
 		}
-		return annot;
+		return Type_Annotation::primitive(type);
 	}
-	bool validate_type(Type_Annotation expected)
+	bool validate_type(const Type_Annotation * expected)
 	{
 		if (type != VALUE_REFERENCE) {
-			return type == expected.val_type;
+			return type == expected->val_type;
 		} else {
-			if (expected.val_type != VALUE_REFERENCE) {
+			if (expected->val_type != VALUE_REFERENCE) {
 				return false;
 			} else {
 				return reference.validate_type(expected);
@@ -168,14 +206,23 @@ struct Value {
 	}
 };
 
+static_assert(sizeof(Value) == 16, "Value should be two words");
+
 /*
  * Objects
  */
 
+/** Obj_Tuple
+ * Elements are stored inline after the length, so a tuple is a single
+ * allocation.
+ */
 struct Obj_Tuple {
 	size_t length;
-	Value * elements;
+	Value elements[];
 
+	static Obj_Tuple * alloc(size_t length);
+	static Obj_Tuple * alloc_permanent(size_t length);
+	void print_to(Sink * sink);
 	char * to_string();
 	void mark_for_gc();
 };
@@ -193,66 +240,88 @@ void Value::mark_for_gc()
 	}
 }
 
-char * Value::to_string()
+void Value::print_to(Sink * sink)
 {
-	String_Builder builder;
 	switch (type) {
 	case VALUE_INTEGER: {
-		char * s = itoa(integer);
-		builder.append(s);
-		free(s);
+		sink->write_int(integer);
 	} break;
 	case VALUE_STRING: {
-		builder.append(string);
+		sink->write(string);
 	} break;
 	case VALUE_TYPE: {
-		builder.append(annotation.to_string());
+		annotation->print_to(sink);
 	} break;
 	case VALUE_REFERENCE: {
-		char * s = reference.to_string();
-		builder.append(s);
-		free(s);
+		reference.print_to(sink);
 	} break;
 	default:
-		fatal_internal("Incomplete switch in Value::to_string()");
+		fatal_internal("Incomplete switch in Value::print_to()");
 		break;
 	}
-	return builder.final_string();
+}
+
+char * Value::to_string()
+{
+	Sink sink;
+	sink.alloc();
+	print_to(&sink);
+	return sink.take_string();
 }
 
 /*
  * Reference
  */
 
-char * Reference::to_string()
+void Reference::print_to(Sink * sink)
 {
+	Obj_Type type = this->type();
 	switch (type) {
 	case OBJ_TUPLE: {
-		return ((Obj_Tuple*) ptr)->to_string();
+		((Obj_Tuple*) ptr)->print_to(sink);
 	} break;
 	default: {
-		String_Builder builder;
-		builder.append("<");
-		builder.append(obj_type_to_string(type));
-		builder.append(" at ");
-		char buf[100]; // Far too big for a pointer string to exceed
-		sprintf(buf, "%p", ptr);
-		builder.append(buf);
-		builder.append(">");
-		return builder.final_string();
+		sink->put('<');
+		sink->write(obj_type_to_string(type));
+		sink->write(" at ");
+		sink->write_pointer(ptr);
+		sink->put('>');
 	} break;
 	}
 }
 
+char * Reference::to_string()
+{
+	Sink sink;
+	sink.alloc();
+	print_to(&sink);
+	return sink.take_string();
+}
+
+// Only shades the object; its children are marked later, by
+// mark_gray_objects()
 void Reference::mark_for_gc()
 {
-	switch (type) {
-	case OBJ_TUPLE: {
-		Collection::mark_ptr(ptr);
-		((Obj_Tuple*) ptr)->mark_for_gc();
-	} break;
-	default:
-		fatal_internal("Incomplete switch at Reference::mark_for_gc()");
+	Collection::shade(ptr);
+}
+
+/** mark_gray_objects
+ * Marks everything reachable from the objects shaded so far. An object
+ * is only queued the first time it's marked, so this is linear in the
+ * number of live objects however they're shared, and the worklist
+ * means deep nesting can't overflow the stack.
+ */
+void mark_gray_objects()
+{
+	while (Collection::gray.size > 0) {
+		void * ptr = Collection::gray.pop();
+		switch (Collection::header_of(ptr)->kind) {
+		case OBJ_TUPLE: {
+			((Obj_Tuple*) ptr)->mark_for_gc();
+		} break;
+		default:
+			fatal_internal("Incomplete switch in mark_gray_objects()");
+		}
 	}
 }
 
@@ -260,23 +329,45 @@ void Reference::mark_for_gc()
  * Obj_Tuple
  */
 
-char * Obj_Tuple::to_string()
+// Elements are left uninitialized
+Obj_Tuple * Obj_Tuple::alloc(size_t length)
+{
+	Obj_Tuple * tuple = (Obj_Tuple*) Collection::alloc(
+		sizeof(Obj_Tuple) + sizeof(Value) * length, OBJ_TUPLE);
+	tuple->length = length;
+	return tuple;
+}
+
+// For constants; elements must be permanent too, or not references
+Obj_Tuple * Obj_Tuple::alloc_permanent(size_t length)
 {
-	String_Builder builder;
-	builder.append("(");
+	Obj_Tuple * tuple = (Obj_Tuple*) Collection::alloc_permanent(
+		sizeof(Obj_Tuple) + sizeof(Value) * length, OBJ_TUPLE);
+	tuple->length = length;
+	return tuple;
+}
+
+void Obj_Tuple::print_to(Sink * sink)
+{
+	sink->put('(');
 	for (int i = 0; i < length; i++) {
-		char * s = elements[i].to_string();
-		builder.append(s);
-		free(s);
-		if (i < length - 1) builder.append(", "); 
+		elements[i].print_to(sink);
+		if (i < length - 1) sink->write(", ", 2);
 	}
-	builder.append(")");
-	return builder.final_string();
+	sink->put(')');
+}
+
+char * Obj_Tuple::to_string()
+{
+	Sink sink;
+	sink.alloc();
+	print_to(&sink);
+	return sink.take_string();
 }
 
+// Shades the elements
 void Obj_Tuple::mark_for_gc()
 {
-	Collection::mark_ptr(elements);
 	for (int i = 0; i < length; i++) {
 		elements[i].mark_for_gc();
 	}